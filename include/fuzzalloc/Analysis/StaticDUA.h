@@ -0,0 +1,49 @@
+//===-- StaticDUA.h - Static def-use chain results --------------*- C++ -*-===//
+///
+/// \file
+/// Load the def-use chains computed by `static-dua`, so that instrumentation
+/// can skip def/use sites that are not part of any (static) def-use chain
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef STATIC_DUA_H
+#define STATIC_DUA_H
+
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/Error.h>
+
+namespace llvm {
+class Instruction;
+class StringRef;
+} // namespace llvm
+
+class VarInfo;
+
+/// Def and use sites that appear in at least one static def-use chain.
+///
+/// Def and use sites are keyed by their source location (recovered through
+/// debug info), so the results remain valid across compilations
+class StaticDUA {
+public:
+  /// Load `static-dua` JSON output
+  static llvm::Expected<StaticDUA> load(const llvm::StringRef &);
+
+  /// Get the static def-use chains given on the command line (or `nullptr` if
+  /// no static def-use chains were given)
+  static const StaticDUA *get();
+
+  /// Returns `true` if the variable definition reaches at least one use
+  bool hasDef(const VarInfo &) const;
+
+  /// Returns `true` if the use is reachable from at least one tagged def
+  bool hasUse(const llvm::Instruction *) const;
+
+  size_t getNumDefs() const { return Defs.size(); }
+  size_t getNumUses() const { return Uses.size(); }
+
+private:
+  llvm::StringSet<> Defs;
+  llvm::StringSet<> Uses;
+};
+
+#endif // STATIC_DUA_H
@@ -0,0 +1,55 @@
+//===-- JSONStream.h - Streaming JSON reader --------------------*- C++ -*-===//
+///
+/// \file
+/// A streaming JSON reader. Values are read in document order (with arrays
+/// visited through callbacks), without building a `json::Value` tree, so large
+/// JSON files (e.g., from `static-dua` or the tracer) can be read directly into
+/// the consumer's data structures.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+#include <stdint.h>
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/Error.h>
+
+class JSONStream {
+public:
+  explicit JSONStream(llvm::StringRef Buf) : Buf(Buf), Pos(0) {}
+
+  /// Read an array, calling the given function (with the element index) to
+  /// read each element
+  llvm::Error readArray(llvm::function_ref<llvm::Error(size_t)>);
+
+  /// Read a string. Strings without escape sequences refer to the underlying
+  /// buffer, and escaped strings are owned by the reader
+  llvm::Expected<llvm::StringRef> readString();
+
+  /// Read an integer
+  llvm::Expected<int64_t> readInteger();
+
+  /// Returns `true` (and consumes it) if the next value is `null`
+  bool readNull();
+
+  /// Check that nothing (but whitespace) remains
+  llvm::Error finish();
+
+  /// Create an error at the current position
+  llvm::Error error(const llvm::Twine &) const;
+
+private:
+  void skipWhitespace();
+  bool consume(char);
+  llvm::Error expect(char);
+
+  llvm::StringRef Buf;
+  size_t Pos;
+  llvm::BumpPtrAllocator Alloc; ///< Owns decoded (escaped) strings
+};
+
+#endif // JSON_STREAM_H
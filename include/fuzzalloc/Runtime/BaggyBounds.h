@@ -19,6 +19,10 @@ extern "C" {
 /// Slot size (in bytes)
 #define kSlotSize (16)
 
+/// Allocation context (mixed into heap tags when context sensitivity is
+/// enabled)
+extern __thread tag_t __bb_alloc_ctx;
+
 /// Efficiently calculate the next power-of-2 of `X`
 uint64_t bb_nextPow2(uint64_t X);
 
@@ -28,10 +32,15 @@ uint64_t bb_log2(uint64_t X);
 void *__bb_malloc(tag_t Tag, size_t Size);
 void *__bb_calloc(tag_t Tag, size_t NMemb, size_t Size);
 void *__bb_realloc(tag_t Tag, void *Ptr, size_t Size);
+void *__bb_aligned_alloc(tag_t Tag, size_t Alignment, size_t Size);
 void __bb_free(void *Ptr);
 
 void __bb_register(void *Obj, size_t Size);
 void __bb_deregister(void *Obj);
+
+/// Optional hook called when an object is deregistered (e.g., by the tracer
+/// runtime, to count live objects)
+void __bb_deregister_hook(void *Obj, size_t AllocSize) __attribute__((weak));
 void *__bb_lookup(void *Ptr, uintptr_t *Base, size_t MetaSize);
 
 #if defined(__cplusplus)
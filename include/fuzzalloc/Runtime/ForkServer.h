@@ -0,0 +1,42 @@
+//===-- ForkServer.h - Coverage replay fork server ----------------*- C -*-===//
+///
+/// \file
+/// Fork server for replaying testcases through the coverage runtimes (tracer
+/// and LLVMCov). The replay tool starts the target with `FUZZALLOC_FORKSERVER`
+/// set and the control and status pipes on `kForkSrvCtlFd` and
+/// `kForkSrvStatusFd`. The protocol is:
+///
+///   server -> tool : uint32 hello
+///   tool -> server : uint32 path length, output path (per input)
+///   server -> tool : int32 child pid, int32 wait status (per input)
+///
+/// Each child writes its coverage to the given output path (via
+/// `LLVM_PROFILE_FILE`). The server exits when the control pipe is closed.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef FORK_SERVER_H
+#define FORK_SERVER_H
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif // __cplusplus
+
+/// Fork server file descriptors
+#define kForkSrvCtlFd (198)
+#define kForkSrvStatusFd (199)
+
+/// Fork server handshake
+#define kForkSrvHello ((uint32_t)0x46534b46)
+
+/// Start the fork server (if `FUZZALLOC_FORKSERVER` is set). Only returns in
+/// the forked children (or if there is no fork server)
+void __fuzzalloc_forkserver(void);
+
+#if defined(__cplusplus)
+}
+#endif // __cplusplus
+
+#endif // FORK_SERVER_H
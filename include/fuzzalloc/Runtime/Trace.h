@@ -0,0 +1,136 @@
+//===-- Trace.h - Tracer def-use trace format -------------------*- C++ -*-===//
+///
+/// \file
+/// The def-use trace written by the tracer runtime, and a reader for it.
+///
+/// Traces are either JSON or a compact binary format. The binary format is:
+///
+///   magic    : "DUATRACE"
+///   version  : uleb128
+///   flags    : uleb128
+///   strings  : uleb128 count, then (uleb128 length, bytes) per string
+///   defs     : uleb128 count, then per def:
+///                var, file, func (string indices), line, column,
+///                [instances, deregistrations],
+///                uleb128 use count, then per use:
+///                  file, func (string indices), line, column, pc, count,
+///                  [min offset, max offset, offset buckets]
+///
+/// All integers are ULEB128-encoded. Def instance counts and offsets are only
+/// present if the `kDUATraceDefCounts` and `kDUATraceOffsets` flags
+/// (respectively) are set. Version 1 traces have no flags. A streamed
+/// trace is a sequence of these chunks (each with its own string table), so the
+/// same def may appear in multiple chunks.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include <memory>
+
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/Error.h>
+
+namespace llvm {
+class raw_ostream;
+namespace json {
+class Value;
+} // namespace json
+} // namespace llvm
+
+static constexpr char kDUATraceMagic[] = "DUATRACE";
+static constexpr uint64_t kDUATraceVersion = 2;
+
+/// Trace flags
+static constexpr uint64_t kDUATraceOffsets = 1 << 0;   ///< Uses record offsets
+static constexpr uint64_t kDUATraceDefCounts = 1 << 1; ///< Defs record counts
+
+/// Source-level location in a trace
+struct TraceLocation {
+  llvm::StringRef File;        ///< File name
+  llvm::StringRef Func;        ///< Function name
+  uint64_t Line;               ///< Line number
+  uint64_t Column;             ///< Column number
+  llvm::Optional<uint64_t> PC; ///< Program counter (uses only)
+};
+
+/// Offsets (from the start of the def) accessed by a traced use
+struct TraceOffsets {
+  uint64_t Min;     ///< Minimum offset
+  uint64_t Max;     ///< Maximum offset
+  uint64_t Buckets; ///< Bitset of log2 offset buckets
+};
+
+/// A traced use of a def
+struct TraceUse {
+  TraceLocation Loc;                    ///< Use location
+  uint64_t Count;                       ///< Number of times the use executed
+  llvm::Optional<TraceOffsets> Offsets; ///< Offsets accessed (if recorded)
+};
+
+/// Dynamic instances of a traced def
+struct TraceDefCounts {
+  uint64_t Instances;    ///< Number of objects created
+  uint64_t Deregistered; ///< Number of objects deregistered
+};
+
+/// A traced def and all of its uses
+struct TraceDef {
+  llvm::StringRef Var;                   ///< Variable name
+  TraceLocation Loc;                     ///< Def location
+  llvm::Optional<TraceDefCounts> Counts; ///< Instance counts (if recorded)
+  llvm::SmallVector<TraceUse, 0> Uses;   ///< Uses
+};
+
+/// A def-use trace generated by the tracer runtime
+class DUATrace {
+public:
+  /// Load a trace. The format (JSON or binary) is detected automatically
+  static llvm::Expected<DUATrace> load(const llvm::StringRef &);
+
+  /// Parse a trace from a buffer
+  static llvm::Expected<DUATrace> parse(const llvm::StringRef &);
+
+  /// Visit each def in a trace buffer without materializing the trace. Strings
+  /// are only valid until the visitor returns
+  static llvm::Error
+  visit(const llvm::StringRef &,
+        llvm::function_ref<llvm::Error(const TraceDef &)>);
+
+  /// Visit each def in a trace file without materializing the trace. Strings
+  /// are only valid until the visitor returns
+  static llvm::Error
+  visitFile(const llvm::StringRef &,
+            llvm::function_ref<llvm::Error(const TraceDef &)>);
+
+  /// Returns `true` if the buffer contains a binary trace
+  static bool isBinary(const llvm::StringRef &);
+
+  llvm::ArrayRef<TraceDef> defs() const { return Defs; }
+
+  /// Convert to the (legacy) JSON format
+  llvm::json::Value toJSON() const;
+
+private:
+  DUATrace() : Alloc(std::make_unique<llvm::BumpPtrAllocator>()) {}
+
+  /// Visit a single binary trace chunk, advancing the buffer past it
+  static llvm::Error
+  visitBinary(llvm::StringRef &,
+              llvm::function_ref<llvm::Error(const TraceDef &)>);
+  static llvm::Error
+  visitJSON(const llvm::StringRef &,
+            llvm::function_ref<llvm::Error(const TraceDef &)>);
+
+  std::unique_ptr<llvm::BumpPtrAllocator> Alloc; ///< Owns trace strings
+  llvm::SmallVector<TraceDef, 0> Defs;
+};
+
+#endif // TRACE_H
@@ -10,19 +10,19 @@
 
 #include <llvm/Support/WithColor.h>
 
-llvm::raw_ostream &error_stream() {
+inline llvm::raw_ostream &error_stream() {
   return llvm::WithColor{llvm::errs(), llvm::HighlightColor::Error} << "[!] ";
 }
 
-llvm::raw_ostream &status_stream() {
+inline llvm::raw_ostream &status_stream() {
   return llvm::WithColor{llvm::outs(), llvm::HighlightColor::Remark} << "[*] ";
 }
 
-llvm::raw_ostream &success_stream() {
+inline llvm::raw_ostream &success_stream() {
   return llvm::WithColor{llvm::outs(), llvm::HighlightColor::String} << "[+] ";
 }
 
-llvm::raw_ostream &warning_stream() {
+inline llvm::raw_ostream &warning_stream() {
   return llvm::WithColor{llvm::errs(), llvm::HighlightColor::Warning} << "[!] ";
 }
 
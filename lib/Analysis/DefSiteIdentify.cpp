@@ -15,6 +15,7 @@
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 
 #include "fuzzalloc/Analysis/DefSiteIdentify.h"
+#include "fuzzalloc/Analysis/StaticDUA.h"
 #include "fuzzalloc/Analysis/VariableRecovery.h"
 #include "fuzzalloc/Streams.h"
 
@@ -43,6 +44,7 @@ static cl::opt<bool>
 //
 
 static unsigned NumDefSites = 0;
+static unsigned NumPrunedDefSites = 0;
 } // anonymous namespace
 
 char DefSiteIdentify::ID = 0;
@@ -54,6 +56,7 @@ void DefSiteIdentify::getAnalysisUsage(AnalysisUsage &AU) const {
 
 bool DefSiteIdentify::runOnModule(Module &M) {
   const auto &Vars = getAnalysis<VariableRecovery>().getVariables();
+  const auto *DUA = StaticDUA::get();
 
   if (ClDefSitesToTrack.isSet(DefSiteTypes::Array)) {
     status_stream() << "[" << M.getName() << "] Tracking array def sites\n";
@@ -70,6 +73,12 @@ bool DefSiteIdentify::runOnModule(Module &M) {
       }
     }
 
+    // Ignore the variable if it's statically known to reach no uses
+    if (DUA && !DUA->hasDef(VI)) {
+      NumPrunedDefSites++;
+      continue;
+    }
+
     // Save the variable's definition if it's one we want to track
     if (ClDefSitesToTrack.isSet(DefSiteTypes::Array) && isa<ArrayType>(Ty)) {
       ToTrack.insert(V);
@@ -81,6 +90,11 @@ bool DefSiteIdentify::runOnModule(Module &M) {
 
   NumDefSites = ToTrack.size();
 
+  if (DUA) {
+    status_stream() << "[" << M.getName() << "] Num. def sites with no static "
+                    << "uses: " << NumPrunedDefSites << '\n';
+  }
+
   return false;
 }
 
@@ -0,0 +1,247 @@
+//===-- StaticDUA.cpp - Static def-use chain results ------------*- C++ -*-===//
+///
+/// \file
+/// Load the def-use chains computed by `static-dua`, so that instrumentation
+/// can skip def/use sites that are not part of any (static) def-use chain
+///
+//===----------------------------------------------------------------------===//
+
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/IR/Instruction.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "fuzzalloc/Analysis/StaticDUA.h"
+#include "fuzzalloc/Analysis/VariableRecovery.h"
+#include "fuzzalloc/JSONStream.h"
+
+using namespace llvm;
+
+namespace {
+//
+// Command-line options
+//
+
+static cl::opt<std::string>
+    ClStaticDUA("fuzzalloc-static-dua",
+                cl::desc("Static def-use chains (generated by static-dua). "
+                         "Def/use sites not in any chain are not instrumented"),
+                cl::value_desc("path"));
+
+//
+// Helper functions
+//
+
+static std::string getDefKey(StringRef Var, StringRef File, int64_t Line) {
+  return (Var + ":" + File + ":" + Twine(Line)).str();
+}
+
+static std::string getUseKey(StringRef File, StringRef Func, int64_t Line,
+                             int64_t Col) {
+  return (File + ":" + Func + ":" + Twine(Line) + ":" + Twine(Col)).str();
+}
+
+static Error malformed(const Twine &Msg) {
+  return createStringError(inconvertibleErrorCode(),
+                           "Malformed static-dua JSON: " + Msg.str());
+}
+} // anonymous namespace
+
+Expected<StaticDUA> StaticDUA::load(const StringRef &Path) {
+  auto BufOrErr = MemoryBuffer::getFile(Path);
+  if (const auto &EC = BufOrErr.getError()) {
+    return errorCodeToError(EC);
+  }
+
+  // Stream the def-use chains (rather than building a JSON tree), as the
+  // output of `static-dua` can be very large
+  JSONStream JS(BufOrErr.get()->getBuffer());
+  StaticDUA DUA;
+
+  // Optional (i.e., nullable) values
+  const auto readStr = [&](Optional<StringRef> &S) -> Error {
+    if (JS.readNull()) {
+      S = None;
+      return Error::success();
+    }
+    auto SOrErr = JS.readString();
+    if (!SOrErr) {
+      return SOrErr.takeError();
+    }
+    S = *SOrErr;
+    return Error::success();
+  };
+
+  const auto readInt = [&](Optional<int64_t> &I) -> Error {
+    if (JS.readNull()) {
+      I = None;
+      return Error::success();
+    }
+    auto IOrErr = JS.readInteger();
+    if (!IOrErr) {
+      return IOrErr.takeError();
+    }
+    I = *IOrErr;
+    return Error::success();
+  };
+
+  // [file, func, line, column]
+  struct Location {
+    Optional<StringRef> File;
+    Optional<StringRef> Func;
+    Optional<int64_t> Line;
+    Optional<int64_t> Col;
+  };
+
+  const auto readLoc = [&](Location &Loc) -> Error {
+    size_t N = 0;
+    auto E = JS.readArray([&](size_t Idx) -> Error {
+      N = Idx + 1;
+      switch (Idx) {
+      case 0:
+        return readStr(Loc.File);
+      case 1:
+        return readStr(Loc.Func);
+      case 2:
+        return readInt(Loc.Line);
+      case 3:
+        return readInt(Loc.Col);
+      default:
+        return malformed("expected a [file, func, line, column] location");
+      }
+    });
+    if (E) {
+      return E;
+    }
+    if (N != 4) {
+      return malformed("expected a [file, func, line, column] location");
+    }
+    return Error::success();
+  };
+
+  // Def: [var, [file, func, line, column]]
+  Optional<StringRef> DefVar;
+  Location DefLoc;
+  const auto readDef = [&]() -> Error {
+    size_t N = 0;
+    auto E = JS.readArray([&](size_t Idx) -> Error {
+      N = Idx + 1;
+      switch (Idx) {
+      case 0:
+        return readStr(DefVar);
+      case 1:
+        return readLoc(DefLoc);
+      default:
+        return malformed("expected a [var, location] def");
+      }
+    });
+    if (E) {
+      return E;
+    }
+    if (N != 2) {
+      return malformed("expected a [var, location] def");
+    }
+    return Error::success();
+  };
+
+  // Uses: [[file, func, line, column], ...]
+  size_t NumUses = 0;
+  const auto readUses = [&]() -> Error {
+    return JS.readArray([&](size_t Idx) -> Error {
+      NumUses = Idx + 1;
+      Location UseLoc;
+      if (auto E = readLoc(UseLoc)) {
+        return E;
+      }
+      if (UseLoc.File && UseLoc.Func && UseLoc.Line && UseLoc.Col) {
+        DUA.Uses.insert(
+            getUseKey(*UseLoc.File, *UseLoc.Func, *UseLoc.Line, *UseLoc.Col));
+      }
+      return Error::success();
+    });
+  };
+
+  auto E = JS.readArray([&](size_t) -> Error {
+    NumUses = 0;
+    size_t N = 0;
+    auto E = JS.readArray([&](size_t Idx) -> Error {
+      N = Idx + 1;
+      switch (Idx) {
+      case 0:
+        return readDef();
+      case 1:
+        return readUses();
+      default:
+        return malformed("expected a [def, uses] pair");
+      }
+    });
+    if (E) {
+      return E;
+    }
+    if (N != 2) {
+      return malformed("expected a [def, uses] pair");
+    }
+
+    // A def that reaches no uses is not interesting. The uses follow the def,
+    // so this can only be checked once the chain has been read
+    if (NumUses > 0 && DefVar && DefLoc.File && DefLoc.Line) {
+      DUA.Defs.insert(getDefKey(*DefVar, *DefLoc.File, *DefLoc.Line));
+    }
+    return Error::success();
+  });
+  if (E) {
+    return std::move(E);
+  }
+  if (auto E = JS.finish()) {
+    return std::move(E);
+  }
+
+  return DUA;
+}
+
+const StaticDUA *StaticDUA::get() {
+  static const Optional<StaticDUA> DUA = []() -> Optional<StaticDUA> {
+    if (ClStaticDUA.empty()) {
+      return None;
+    }
+
+    auto DUAOrErr = StaticDUA::load(ClStaticDUA);
+    if (auto E = DUAOrErr.takeError()) {
+      std::string Err;
+      raw_string_ostream OS(Err);
+      OS << "Unable to load static def-use chains from " << ClStaticDUA << ": "
+         << toString(std::move(E));
+      OS.flush();
+      report_fatal_error(StringRef(Err));
+    }
+    return std::move(*DUAOrErr);
+  }();
+
+  return DUA ? DUA.getPointer() : nullptr;
+}
+
+bool StaticDUA::hasDef(const VarInfo &VI) const {
+  // Be conservative if we cannot recover the source-level variable
+  const auto *DIVar = VI.getDbgVar();
+  if (!DIVar) {
+    return true;
+  }
+
+  return Defs.count(
+      getDefKey(DIVar->getName(), DIVar->getFilename(), DIVar->getLine()));
+}
+
+bool StaticDUA::hasUse(const Instruction *I) const {
+  // Be conservative if we cannot recover the source-level location. This key
+  // must match how `static-dua` serializes use sites
+  const auto &Loc = I->getDebugLoc();
+  if (!Loc) {
+    return true;
+  }
+
+  const auto *SP = getDISubprogram(Loc.getScope());
+  return Uses.count(getUseKey(SP->getFile()->getFilename(), SP->getName(),
+                              Loc.getLine(), Loc.getCol()));
+}
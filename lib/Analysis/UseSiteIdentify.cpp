@@ -15,6 +15,7 @@
 #include <llvm/Transforms/Instrumentation/AddressSanitizerCommon.h>
 #include <llvm/Transforms/Utils/PromoteMemToReg.h>
 
+#include "fuzzalloc/Analysis/StaticDUA.h"
 #include "fuzzalloc/Analysis/UseSiteIdentify.h"
 #include "fuzzalloc/Metadata.h"
 #include "fuzzalloc/Streams.h"
@@ -52,6 +53,7 @@ static cl::opt<bool> ClTrackByval("fuzzalloc-track-byvals",
 static unsigned NumUsesToTrack = 0;
 static unsigned NumReadUseSites = 0;
 static unsigned NumWriteUseSites = 0;
+static unsigned NumPrunedUseSites = 0;
 
 //
 // Helper functions
@@ -219,6 +221,7 @@ bool UseSiteIdentify::runOnFunction(Function &F) {
 
   UseSiteOperands InterestingOperands;
   SmallPtrSet<Value *, 16> TempsToTrack;
+  const auto *DUA = StaticDUA::get();
 
   for (auto &BB : F) {
     TempsToTrack.clear();
@@ -227,6 +230,12 @@ bool UseSiteIdentify::runOnFunction(Function &F) {
       getInterestingMemoryOperands(&I, InterestingOperands);
 
       for (auto &Operand : InterestingOperands) {
+        // Skip use sites that are statically unreachable from any tagged def
+        if (DUA && !DUA->hasUse(Operand.getInsn())) {
+          NumPrunedUseSites++;
+          continue;
+        }
+
         if (ClOpt) {
           auto *Ptr = Operand.getPtr();
           // If we have a mask, skip instrumentation if we've already
@@ -278,6 +287,11 @@ bool UseSiteIdentify::runOnModule(Module &M) {
     Changed = runOnFunction(F);
   }
 
+  if (StaticDUA::get()) {
+    status_stream() << "[" << M.getName() << "] Num. use sites with no static "
+                    << "defs: " << NumPrunedUseSites << '\n';
+  }
+
   return Changed;
 }
 
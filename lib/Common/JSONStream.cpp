@@ -0,0 +1,208 @@
+//===-- JSONStream.cpp - Streaming JSON reader ------------------*- C++ -*-===//
+///
+/// \file
+/// A streaming JSON reader
+///
+//===----------------------------------------------------------------------===//
+
+#include <string>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/Support/ConvertUTF.h>
+#include <llvm/Support/StringSaver.h>
+
+#include "fuzzalloc/JSONStream.h"
+
+using namespace llvm;
+
+void JSONStream::skipWhitespace() {
+  while (Pos < Buf.size() && isSpace(Buf[Pos])) {
+    Pos++;
+  }
+}
+
+bool JSONStream::consume(char C) {
+  skipWhitespace();
+  if (Pos < Buf.size() && Buf[Pos] == C) {
+    Pos++;
+    return true;
+  }
+  return false;
+}
+
+Error JSONStream::expect(char C) {
+  if (!consume(C)) {
+    return error(Twine("expected '") + Twine(C) + "'");
+  }
+  return Error::success();
+}
+
+Error JSONStream::error(const Twine &Msg) const {
+  return createStringError(inconvertibleErrorCode(),
+                           "Invalid JSON at offset " + Twine(Pos) + ": " +
+                               Msg.str());
+}
+
+Error JSONStream::readArray(function_ref<Error(size_t)> ReadElem) {
+  if (auto E = expect('[')) {
+    return E;
+  }
+  if (consume(']')) {
+    return Error::success();
+  }
+
+  for (size_t Idx = 0;; ++Idx) {
+    if (auto E = ReadElem(Idx)) {
+      return E;
+    }
+    if (consume(']')) {
+      return Error::success();
+    }
+    if (auto E = expect(',')) {
+      return E;
+    }
+  }
+}
+
+Expected<StringRef> JSONStream::readString() {
+  if (auto E = expect('"')) {
+    return std::move(E);
+  }
+
+  // Fast path: no escape sequences
+  const auto Start = Pos;
+  while (Pos < Buf.size() && Buf[Pos] != '"' && Buf[Pos] != '\\') {
+    Pos++;
+  }
+  if (Pos >= Buf.size()) {
+    return error("unterminated string");
+  }
+  if (Buf[Pos] == '"') {
+    return Buf.slice(Start, Pos++);
+  }
+
+  std::string S = Buf.slice(Start, Pos).str();
+  while (Pos < Buf.size() && Buf[Pos] != '"') {
+    const auto C = Buf[Pos++];
+    if (C != '\\') {
+      S.push_back(C);
+      continue;
+    }
+    if (Pos >= Buf.size()) {
+      break;
+    }
+
+    switch (Buf[Pos++]) {
+    case '"':
+      S.push_back('"');
+      break;
+    case '\\':
+      S.push_back('\\');
+      break;
+    case '/':
+      S.push_back('/');
+      break;
+    case 'b':
+      S.push_back('\b');
+      break;
+    case 'f':
+      S.push_back('\f');
+      break;
+    case 'n':
+      S.push_back('\n');
+      break;
+    case 'r':
+      S.push_back('\r');
+      break;
+    case 't':
+      S.push_back('\t');
+      break;
+    case 'u': {
+      const auto readHex = [&]() -> Optional<uint32_t> {
+        uint32_t V;
+        if (Pos + 4 > Buf.size() || Buf.substr(Pos, 4).getAsInteger(16, V)) {
+          return None;
+        }
+        Pos += 4;
+        return V;
+      };
+
+      auto CP = readHex();
+      if (!CP) {
+        return error("invalid \\u escape");
+      }
+
+      // Surrogate pair
+      if (*CP >= 0xD800 && *CP < 0xDC00 && Buf.substr(Pos).startswith("\\u")) {
+        Pos += 2;
+        const auto Lo = readHex();
+        if (!Lo || *Lo < 0xDC00 || *Lo >= 0xE000) {
+          return error("invalid surrogate pair");
+        }
+        *CP = 0x10000 + ((*CP - 0xD800) << 10) + (*Lo - 0xDC00);
+      }
+
+      char UTF8[UNI_MAX_UTF8_BYTES_PER_CODE_POINT];
+      char *End = UTF8;
+      if (!ConvertCodePointToUTF8(*CP, End)) {
+        return error("invalid code point");
+      }
+      S.append(UTF8, End);
+      break;
+    }
+    default:
+      return error("invalid escape sequence");
+    }
+  }
+  if (Pos >= Buf.size()) {
+    return error("unterminated string");
+  }
+  Pos++;
+
+  return StringSaver(Alloc).save(S);
+}
+
+Expected<int64_t> JSONStream::readInteger() {
+  skipWhitespace();
+
+  const auto Start = Pos;
+  if (Pos < Buf.size() && Buf[Pos] == '-') {
+    Pos++;
+  }
+  while (Pos < Buf.size() && isDigit(Buf[Pos])) {
+    Pos++;
+  }
+
+  const auto Num = Buf.slice(Start, Pos);
+  int64_t V;
+  if (!Num.getAsInteger(10, V)) {
+    return V;
+  }
+
+  // Values above `INT64_MAX` (e.g., bitsets) wrap around
+  uint64_t U;
+  if (!Num.getAsInteger(10, U)) {
+    return static_cast<int64_t>(U);
+  }
+
+  Pos = Start;
+  return error("expected an integer");
+}
+
+bool JSONStream::readNull() {
+  skipWhitespace();
+  if (Buf.substr(Pos).startswith("null")) {
+    Pos += 4;
+    return true;
+  }
+  return false;
+}
+
+Error JSONStream::finish() {
+  skipWhitespace();
+  if (Pos != Buf.size()) {
+    return error("unexpected trailing data");
+  }
+  return Error::success();
+}
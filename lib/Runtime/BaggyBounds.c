@@ -29,6 +29,8 @@ static const size_t kTableSize = 1UL << 43; ///< Baggy bounds table size
 static uint8_t *__baggy_bounds_table;
 static bool Initialized = false;
 
+__thread tag_t __bb_alloc_ctx = 0;
+
 /// Initialize the baggy bounds table
 static void initBaggyBounds() {
 #ifdef _DEBUG
@@ -84,6 +86,10 @@ void __bb_deregister(void *Obj) {
   const uintptr_t Index = P >> kSlotSizeLog2;
   const unsigned AllocSize = __baggy_bounds_table[Index];
   if (AllocSize != 0) {
+    if (__bb_deregister_hook) {
+      __bb_deregister_hook(Obj, 1UL << AllocSize);
+    }
+
     const size_t Range = 1 << (AllocSize - kSlotSizeLog2);
     memset(__baggy_bounds_table + Index, 0, Range);
   }
@@ -108,6 +114,23 @@ void *__bb_malloc(tag_t Tag, size_t Size) {
   return Ptr;
 }
 
+void *__bb_aligned_alloc(tag_t Tag, size_t Alignment, size_t Size) {
+  // Allocations are already aligned to their (power-of-2) allocation size. So
+  // we only need to grow the allocation if the requested alignment is larger
+  size_t AllocSize = calculateAllocSize(Size, sizeof(Tag));
+  if (Alignment > AllocSize) {
+    AllocSize = bb_nextPow2(Alignment);
+  }
+  void *Ptr;
+  if (posix_memalign(&Ptr, AllocSize, AllocSize) != 0) {
+    return NULL;
+  }
+  __bb_register(Ptr, AllocSize);
+  tag_t *TagAddr = (tag_t *)((uintptr_t)Ptr + AllocSize - sizeof(Tag));
+  *TagAddr = Tag;
+  return Ptr;
+}
+
 void *__bb_calloc(tag_t Tag, size_t NMemb, size_t Size) {
   void *Ptr = __bb_malloc(Tag, NMemb * Size);
   if (Ptr) {
@@ -18,3 +18,7 @@ void *calloc(size_t NMemb, size_t Size) {
 void *realloc(void *Ptr, size_t Size) {
   return __bb_realloc(kFuzzallocDefaultTag, Ptr, Size);
 }
+
+void *aligned_alloc(size_t Alignment, size_t Size) {
+  return __bb_aligned_alloc(kFuzzallocDefaultTag, Alignment, Size);
+}
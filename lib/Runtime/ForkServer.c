@@ -0,0 +1,95 @@
+//===-- ForkServer.c - Coverage replay fork server ----------------*- C -*-===//
+///
+/// \file
+/// Fork server for replaying testcases through the coverage runtimes
+///
+//===----------------------------------------------------------------------===//
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fuzzalloc/Runtime/ForkServer.h"
+
+static int readAll(int Fd, void *Buf, size_t Len) {
+  char *P = Buf;
+  while (Len > 0) {
+    ssize_t N = read(Fd, P, Len);
+    if (N <= 0) {
+      return 0;
+    }
+    P += N;
+    Len -= N;
+  }
+  return 1;
+}
+
+static int writeAll(int Fd, const void *Buf, size_t Len) {
+  const char *P = Buf;
+  while (Len > 0) {
+    ssize_t N = write(Fd, P, Len);
+    if (N <= 0) {
+      return 0;
+    }
+    P += N;
+    Len -= N;
+  }
+  return 1;
+}
+
+void __fuzzalloc_forkserver(void) {
+  // Both runtimes may be linked into the same target
+  static int Started = 0;
+  if (Started) {
+    return;
+  }
+  Started = 1;
+
+  if (!getenv("FUZZALLOC_FORKSERVER")) {
+    return;
+  }
+  unsetenv("FUZZALLOC_FORKSERVER");
+
+  const uint32_t Hello = kForkSrvHello;
+  if (!writeAll(kForkSrvStatusFd, &Hello, sizeof(Hello))) {
+    return;
+  }
+
+  static char Path[PATH_MAX];
+  for (;;) {
+    uint32_t Len;
+    if (!readAll(kForkSrvCtlFd, &Len, sizeof(Len)) || Len >= PATH_MAX ||
+        !readAll(kForkSrvCtlFd, Path, Len)) {
+      _exit(0);
+    }
+    Path[Len] = '\0';
+
+    pid_t Child = fork();
+    if (Child < 0) {
+      _exit(1);
+    }
+
+    // The child writes its coverage to the given path
+    if (Child == 0) {
+      close(kForkSrvCtlFd);
+      close(kForkSrvStatusFd);
+      setenv("LLVM_PROFILE_FILE", Path, 1);
+      return;
+    }
+
+    int32_t Pid = Child;
+    int Status;
+    if (!writeAll(kForkSrvStatusFd, &Pid, sizeof(Pid)) ||
+        waitpid(Child, &Status, 0) < 0) {
+      _exit(1);
+    }
+
+    int32_t St = Status;
+    if (!writeAll(kForkSrvStatusFd, &St, sizeof(St))) {
+      _exit(1);
+    }
+  }
+}
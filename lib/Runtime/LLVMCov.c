@@ -11,10 +11,15 @@
 #include <strings.h>
 #include <sys/time.h>
 
+#include "fuzzalloc/Runtime/ForkServer.h"
+
 int __llvm_profile_runtime = 0;
 void __llvm_profile_initialize_file(void);
 int __llvm_profile_write_file(void);
 
+/// Only defined if the target is also linked with the tracer runtime
+void __tracer_timeout(void (*)(void)) __attribute__((weak));
+
 static void writeProfile() {
   struct itimerval It = {};
 
@@ -27,12 +32,20 @@ static void writeProfile() {
 
 static void handleTimeout(int Sig) { exit(0); }
 
+// Start the fork server before any other constructor runs, so each forked child
+// runs the target from scratch
+__attribute__((constructor(101))) static void __llvm_cov_forkserver() {
+  __fuzzalloc_forkserver();
+}
+
 __attribute__((constructor)) static void __llvm_cov_initialize_timeout() {
   const char *Timeout = getenv("LLVM_PROFILE_TIMEOUT");
   struct sigaction SA = {};
   struct itimerval It = {};
 
-  if (Timeout) {
+  // The tracer handles the timeout itself (exiting once the trace is safely
+  // serialized), so that both the trace and the raw profile are written
+  if (Timeout && !__tracer_timeout) {
     long long T = atoll(Timeout);
     SA.sa_handler = handleTimeout;
     sigaction(SIGALRM, &SA, NULL);
@@ -0,0 +1,445 @@
+//===-- Trace.cpp - Tracer def-use trace reader -----------------*- C++ -*-===//
+///
+/// \file
+/// Read def-use traces (JSON or binary) generated by the tracer runtime
+///
+//===----------------------------------------------------------------------===//
+
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/LEB128.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/StringSaver.h>
+
+#include "fuzzalloc/JSONStream.h"
+#include "fuzzalloc/Runtime/Trace.h"
+
+using namespace llvm;
+
+namespace {
+//
+// Helper functions
+//
+
+static Error malformed(const Twine &Msg) {
+  return createStringError(inconvertibleErrorCode(),
+                           "Malformed def-use trace: " + Msg.str());
+}
+
+static json::Value toJSON(const TraceLocation &Loc) {
+  if (Loc.PC) {
+    return {Loc.File, Loc.Func, Loc.Line, Loc.Column, *Loc.PC};
+  }
+  return {Loc.File, Loc.Func, Loc.Line, Loc.Column};
+}
+
+/// Sequential reader for the binary trace format
+class BinaryReader {
+public:
+  BinaryReader(StringRef Buf)
+      : Cur(Buf.bytes_begin()), End(Buf.bytes_end()) {}
+
+  Expected<uint64_t> readULEB128() {
+    const char *Err = nullptr;
+    unsigned N = 0;
+    const auto V = decodeULEB128(Cur, &N, End, &Err);
+    if (Err) {
+      return malformed(Err);
+    }
+    Cur += N;
+    return V;
+  }
+
+  Expected<StringRef> readString() {
+    auto LenOrErr = readULEB128();
+    if (!LenOrErr) {
+      return LenOrErr.takeError();
+    }
+    if (*LenOrErr > static_cast<uint64_t>(End - Cur)) {
+      return malformed("string out of bounds");
+    }
+    StringRef S(reinterpret_cast<const char *>(Cur), *LenOrErr);
+    Cur += *LenOrErr;
+    return S;
+  }
+
+  /// Remaining (unread) bytes
+  StringRef remaining() const {
+    return StringRef(reinterpret_cast<const char *>(Cur), End - Cur);
+  }
+
+private:
+  const uint8_t *Cur;
+  const uint8_t *End;
+};
+} // anonymous namespace
+
+bool DUATrace::isBinary(const StringRef &Buf) {
+  return Buf.startswith(StringRef(kDUATraceMagic, sizeof(kDUATraceMagic) - 1));
+}
+
+Expected<DUATrace> DUATrace::load(const StringRef &Path) {
+  auto BufOrErr = MemoryBuffer::getFile(Path);
+  if (const auto &EC = BufOrErr.getError()) {
+    return errorCodeToError(EC);
+  }
+
+  return parse(BufOrErr.get()->getBuffer());
+}
+
+Expected<DUATrace> DUATrace::parse(const StringRef &Buf) {
+  DUATrace Trace;
+  UniqueStringSaver Saver(*Trace.Alloc);
+
+  const auto saveLoc = [&](TraceLocation &Loc) {
+    Loc.File = Saver.save(Loc.File);
+    Loc.Func = Saver.save(Loc.Func);
+  };
+
+  auto E = visit(Buf, [&](const TraceDef &TDef) {
+    auto &Def = Trace.Defs.emplace_back(TDef);
+    Def.Var = Saver.save(Def.Var);
+    saveLoc(Def.Loc);
+    for (auto &Use : Def.Uses) {
+      saveLoc(Use.Loc);
+    }
+    return Error::success();
+  });
+  if (E) {
+    return std::move(E);
+  }
+
+  return std::move(Trace);
+}
+
+Error DUATrace::visit(const StringRef &Buf,
+                      function_ref<Error(const TraceDef &)> Visit) {
+  if (!isBinary(Buf)) {
+    return visitJSON(Buf, Visit);
+  }
+
+  // Streamed traces consist of multiple chunks
+  auto Chunks = Buf;
+  while (!Chunks.empty()) {
+    if (!isBinary(Chunks)) {
+      return malformed("expected a trace chunk");
+    }
+    if (auto E = visitBinary(Chunks, Visit)) {
+      return E;
+    }
+  }
+
+  return Error::success();
+}
+
+Error DUATrace::visitFile(const StringRef &Path,
+                          function_ref<Error(const TraceDef &)> Visit) {
+  auto BufOrErr = MemoryBuffer::getFile(Path);
+  if (const auto &EC = BufOrErr.getError()) {
+    return errorCodeToError(EC);
+  }
+
+  return visit(BufOrErr.get()->getBuffer(), Visit);
+}
+
+Error DUATrace::visitBinary(StringRef &Buf,
+                            function_ref<Error(const TraceDef &)> Visit) {
+  BinaryReader R(Buf.drop_front(sizeof(kDUATraceMagic) - 1));
+
+#define READ(Var, Expr)                                                        \
+  auto Var##OrErr = (Expr);                                                    \
+  if (!Var##OrErr) {                                                           \
+    return Var##OrErr.takeError();                                             \
+  }                                                                            \
+  const auto Var = *Var##OrErr;
+
+  READ(Version, R.readULEB128());
+  if (Version == 0 || Version > kDUATraceVersion) {
+    return malformed("unsupported version " + Twine(Version));
+  }
+
+  uint64_t Flags = 0;
+  if (Version > 1) {
+    READ(F, R.readULEB128());
+    Flags = F;
+  }
+
+  // String table
+  READ(NumStrs, R.readULEB128());
+  SmallVector<StringRef, 0> Strs;
+  Strs.reserve(NumStrs);
+  for (uint64_t I = 0; I < NumStrs; ++I) {
+    READ(S, R.readString());
+    Strs.push_back(S);
+  }
+
+  const auto readStr = [&]() -> Expected<StringRef> {
+    READ(Idx, R.readULEB128());
+    if (Idx >= Strs.size()) {
+      return malformed("string index out of bounds");
+    }
+    return Strs[Idx];
+  };
+
+  // Defs and uses. The def is reused to avoid reallocating its uses
+  TraceDef Def;
+  READ(NumDefs, R.readULEB128());
+  for (uint64_t I = 0; I < NumDefs; ++I) {
+    READ(DefVar, readStr());
+    READ(DefFile, readStr());
+    READ(DefFunc, readStr());
+    READ(DefLine, R.readULEB128());
+    READ(DefColumn, R.readULEB128());
+
+    Def.Var = DefVar;
+    Def.Loc = {DefFile, DefFunc, DefLine, DefColumn, None};
+    Def.Counts = None;
+    Def.Uses.clear();
+
+    if (Flags & kDUATraceDefCounts) {
+      READ(Instances, R.readULEB128());
+      READ(Deregistered, R.readULEB128());
+      Def.Counts = {Instances, Deregistered};
+    }
+
+    READ(NumUses, R.readULEB128());
+    Def.Uses.reserve(NumUses);
+    for (uint64_t J = 0; J < NumUses; ++J) {
+      READ(UseFile, readStr());
+      READ(UseFunc, readStr());
+      READ(UseLine, R.readULEB128());
+      READ(UseColumn, R.readULEB128());
+      READ(UsePC, R.readULEB128());
+      READ(UseCount, R.readULEB128());
+
+      auto &Use = Def.Uses.emplace_back();
+      Use.Loc = {UseFile, UseFunc, UseLine, UseColumn, UsePC};
+      Use.Count = UseCount;
+
+      if (Flags & kDUATraceOffsets) {
+        READ(MinOffset, R.readULEB128());
+        READ(MaxOffset, R.readULEB128());
+        READ(OffsetBuckets, R.readULEB128());
+        Use.Offsets = {MinOffset, MaxOffset, OffsetBuckets};
+      }
+    }
+
+    if (auto E = Visit(Def)) {
+      return E;
+    }
+  }
+
+#undef READ
+
+  Buf = R.remaining();
+  return Error::success();
+}
+
+Error DUATrace::visitJSON(const StringRef &Buf,
+                          function_ref<Error(const TraceDef &)> Visit) {
+  JSONStream JS(Buf);
+
+  const auto readInt = [&](uint64_t &V) -> Error {
+    auto VOrErr = JS.readInteger();
+    if (!VOrErr) {
+      return VOrErr.takeError();
+    }
+    V = *VOrErr;
+    return Error::success();
+  };
+
+  const auto readStr = [&](StringRef &S) -> Error {
+    auto SOrErr = JS.readString();
+    if (!SOrErr) {
+      return SOrErr.takeError();
+    }
+    S = *SOrErr;
+    return Error::success();
+  };
+
+  // [file, func, line, column, (pc)]
+  const auto readLoc = [&](TraceLocation &Loc, size_t Size) -> Error {
+    size_t N = 0;
+    Loc.PC = None;
+    auto E = JS.readArray([&](size_t Idx) -> Error {
+      N = Idx + 1;
+      switch (Idx) {
+      case 0:
+        return readStr(Loc.File);
+      case 1:
+        return readStr(Loc.Func);
+      case 2:
+        return readInt(Loc.Line);
+      case 3:
+        return readInt(Loc.Column);
+      case 4:
+        if (Size == 5) {
+          uint64_t PC;
+          if (auto E = readInt(PC)) {
+            return E;
+          }
+          Loc.PC = PC;
+          return Error::success();
+        }
+        LLVM_FALLTHROUGH;
+      default:
+        return malformed("unexpected location element");
+      }
+    });
+    if (E) {
+      return E;
+    }
+    if (N != Size) {
+      return Size == 5
+                 ? malformed("expected a [file, func, line, column, pc] "
+                             "location")
+                 : malformed("expected a [file, func, line, column] location");
+    }
+    return Error::success();
+  };
+
+  // Tuple of integers (e.g., counts or offsets)
+  const auto readTuple = [&](MutableArrayRef<uint64_t> Vals,
+                             const char *Msg) -> Error {
+    size_t N = 0;
+    auto E = JS.readArray([&](size_t Idx) -> Error {
+      N = Idx + 1;
+      if (Idx >= Vals.size()) {
+        return malformed(Msg);
+      }
+      return readInt(Vals[Idx]);
+    });
+    if (E) {
+      return E;
+    }
+    if (N != Vals.size()) {
+      return malformed(Msg);
+    }
+    return Error::success();
+  };
+
+  // [var, [file, func, line, column], (counts)]
+  TraceDef Def;
+  const auto readDef = [&]() -> Error {
+    size_t N = 0;
+    Def.Counts = None;
+    auto E = JS.readArray([&](size_t Idx) -> Error {
+      N = Idx + 1;
+      switch (Idx) {
+      case 0:
+        return readStr(Def.Var);
+      case 1:
+        return readLoc(Def.Loc, 4);
+      case 2: {
+        uint64_t Counts[2];
+        if (auto E = readTuple(Counts, "expected an [instances, "
+                                       "deregistrations] tuple")) {
+          return E;
+        }
+        Def.Counts = {Counts[0], Counts[1]};
+        return Error::success();
+      }
+      default:
+        return malformed("expected a [var, location, (counts)] def");
+      }
+    });
+    if (E) {
+      return E;
+    }
+    if (N < 2) {
+      return malformed("expected a [var, location, (counts)] def");
+    }
+    return Error::success();
+  };
+
+  // [[file, func, line, column, pc], count, (offsets)]
+  const auto readUse = [&]() -> Error {
+    auto &Use = Def.Uses.emplace_back();
+    size_t N = 0;
+    auto E = JS.readArray([&](size_t Idx) -> Error {
+      N = Idx + 1;
+      switch (Idx) {
+      case 0:
+        return readLoc(Use.Loc, 5);
+      case 1:
+        return readInt(Use.Count);
+      case 2: {
+        uint64_t Offsets[3];
+        if (auto E = readTuple(Offsets,
+                               "expected a [min, max, buckets] offset tuple")) {
+          return E;
+        }
+        Use.Offsets = {Offsets[0], Offsets[1], Offsets[2]};
+        return Error::success();
+      }
+      default:
+        return malformed("expected a [use, count, (offsets)] tuple");
+      }
+    });
+    if (E) {
+      return E;
+    }
+    if (N < 2) {
+      return malformed("expected a [use, count, (offsets)] tuple");
+    }
+    return Error::success();
+  };
+
+  // [[def, [use, ...]], ...]
+  auto E = JS.readArray([&](size_t) -> Error {
+    Def.Uses.clear();
+    size_t N = 0;
+    auto E = JS.readArray([&](size_t Idx) -> Error {
+      N = Idx + 1;
+      switch (Idx) {
+      case 0:
+        return readDef();
+      case 1:
+        return JS.readArray([&](size_t) { return readUse(); });
+      default:
+        return malformed("expected a [def, uses] pair");
+      }
+    });
+    if (E) {
+      return E;
+    }
+    if (N != 2) {
+      return malformed("expected a [def, uses] pair");
+    }
+    return Visit(Def);
+  });
+  if (E) {
+    return E;
+  }
+
+  return JS.finish();
+}
+
+json::Value DUATrace::toJSON() const {
+  json::Array J;
+  J.reserve(Defs.size());
+
+  for (const auto &Def : Defs) {
+    json::Array JUses;
+    JUses.reserve(Def.Uses.size());
+    for (const auto &Use : Def.Uses) {
+      if (Use.Offsets) {
+        const auto &Offsets = *Use.Offsets;
+        JUses.push_back(
+            {::toJSON(Use.Loc), Use.Count,
+             json::Array{Offsets.Min, Offsets.Max, Offsets.Buckets}});
+      } else {
+        JUses.push_back({::toJSON(Use.Loc), Use.Count});
+      }
+    }
+
+    json::Array JDef{Def.Var, ::toJSON(Def.Loc)};
+    if (Def.Counts) {
+      JDef.push_back(json::Array{Def.Counts->Instances,
+                                 Def.Counts->Deregistered});
+    }
+
+    J.push_back({std::move(JDef), std::move(JUses)});
+  }
+
+  return J;
+}
@@ -5,23 +5,41 @@
 ///
 //===----------------------------------------------------------------------===//
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <thread>
 
 #include <inttypes.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <linux/membarrier.h>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/JSON.h>
+#include <llvm/Support/LEB128.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include "fuzzalloc/Runtime/BaggyBounds.h"
+#include "fuzzalloc/Runtime/ForkServer.h"
+#include "fuzzalloc/Runtime/Trace.h"
 #include "fuzzalloc/fuzzalloc.h"
 
 #define likely(x) __builtin_expect((x), 1)
@@ -43,9 +61,16 @@ struct __attribute__((packed)) SrcDefinition {
   const SrcLocation Loc; ///< Location
   const char *Var;       ///< Variable name
 };
+
+/// Only defined if the target also has source-based coverage (and is linked
+/// with the LLVMCov runtime)
+extern int __llvm_profile_runtime __attribute__((weak));
 } // extern "C"
 
 namespace {
+/// Returns `true` if the target also has source-based coverage
+static bool hasSourceCoverage() { return &__llvm_profile_runtime != nullptr; }
+
 /// Runtime location
 struct RuntimeLocation {
   const SrcLocation *SrcLoc; ///< Source location
@@ -68,18 +93,150 @@ static json::Value toJSON(const RuntimeLocation &Loc) {
   return {SLoc->File, SLoc->Func, SLoc->Line, SLoc->Column, Loc.PC};
 }
 
-static json::Value toJSON(const SrcDefinition &Def) {
-  return {Def.Var, toJSON(Def.Loc)};
+/// Record the offsets accessed by each (def, use) pair
+static bool RecordOffsets = false;
+
+/// Only record the first occurrence of each (def, use) pair
+static bool SampleUses = false;
+
+/// Count def deregistrations (and hence live objects)
+static bool TrackLive = false;
+
+/// Registered for expedited private membarriers. If so, the serializer's
+/// membarrier orders each traced thread's accesses, so the tracing hooks only
+/// need a compiler barrier
+static bool HasMembarrier = false;
+
+/// Order a hook's `Busy` store before its `Stopped` load. Pairs with the
+/// serializer's `heavyBarrier`
+static inline void lightBarrier() {
+  if (likely(HasMembarrier)) {
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+  } else {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+/// Order the serializer's `Stopped` store before its `Busy` loads, on every
+/// thread. Async-signal-safe
+static void heavyBarrier() {
+  if (HasMembarrier) {
+    syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+  } else {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+}
+
+/// An action to take on timeout (e.g., serialize the trace)
+using TimeoutAction = void (*)();
+
+/// A timeout action deferred by the signal handler, because the interrupted
+/// thread was updating its table or holding the logger's lock
+static std::atomic<TimeoutAction> PendingTimeout = nullptr;
+
+/// Depth of the current thread's critical sections (see `CriticalSection`)
+static thread_local unsigned CriticalDepth = 0;
+
+/// Run a deferred timeout action (if any). Called by the interrupted thread
+/// once it leaves the tracer's state consistent
+static inline void runPendingTimeout() {
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  if (unlikely(PendingTimeout.load(std::memory_order_relaxed) != nullptr)) {
+    if (auto Action = PendingTimeout.exchange(nullptr)) {
+      Action();
+    }
+  }
+}
+
+/// Marks a region in which the current thread holds the logger's lock (or is
+/// allocating its table), so a timeout on this thread must be deferred until
+/// the region is left
+class CriticalSection {
+public:
+  CriticalSection() { CriticalDepth++; }
+  CriticalSection(const CriticalSection &) = delete;
+
+  ~CriticalSection() {
+    if (--CriticalDepth == 0) {
+      runPendingTimeout();
+    }
+  }
+};
+
+/// The range of offsets (from the start of the def) accessed by a use, plus a
+/// bitset of log2 offset buckets. Bucket 0 is offset 0, bucket `i` covers
+/// offsets in `[2^(i-1), 2^i)`
+struct OffsetStats {
+  size_t Min = SIZE_MAX;
+  size_t Max = 0;
+  uint64_t Buckets = 0;
+
+  static unsigned getBucket(size_t Offset) {
+    return Offset == 0 ? 0 : std::min(64 - __builtin_clzll(Offset), 63);
+  }
+
+  void add(size_t Offset) {
+    Min = std::min(Min, Offset);
+    Max = std::max(Max, Offset);
+    Buckets |= 1ULL << getBucket(Offset);
+  }
+
+  void merge(const OffsetStats &Other) {
+    Min = std::min(Min, Other.Min);
+    Max = std::max(Max, Other.Max);
+    Buckets |= Other.Buckets;
+  }
+};
+
+/// Statistics for a use of a def at a particular runtime location
+struct UseStats {
+  size_t Count = 0;    ///< Number of uses
+  OffsetStats Offsets; ///< Offsets accessed (if recording offsets)
+
+  void merge(const UseStats &Other) {
+    Count += Other.Count;
+    Offsets.merge(Other.Offsets);
+  }
+};
+
+/// Dynamic instances of a def
+struct DefStats {
+  size_t Instances = 0;    ///< Number of objects created
+  size_t Deregistered = 0; ///< Number of objects deregistered (if tracked)
+
+  void merge(const DefStats &Other) {
+    Instances += Other.Instances;
+    Deregistered += Other.Deregistered;
+  }
+};
+
+using LocationStatsMap = std::map<RuntimeLocation, UseStats>;
+
+/// A def and its uses
+struct DefEntry {
+  DefStats Stats;        ///< Def instances
+  LocationStatsMap Uses; ///< Uses
+};
+
+using DefUseMap = std::map<const SrcDefinition *, DefEntry>;
+
+static json::Value toJSON(const DefStats &Stats) {
+  return {Stats.Instances, Stats.Deregistered};
 }
 
-using LocationCountMap = std::map<RuntimeLocation, size_t>;
-using DefUseMap = std::map<const SrcDefinition *, LocationCountMap>;
+static json::Value toJSON(const OffsetStats &Offsets) {
+  return {Offsets.Min, Offsets.Max, Offsets.Buckets};
+}
 
-static json::Value toJSON(const LocationCountMap &Locs) {
+static json::Value toJSON(const LocationStatsMap &Locs) {
   std::vector<json::Value> Vec;
 
-  for (const auto &[Loc, Count] : Locs) {
-    Vec.push_back({toJSON(Loc), Count});
+  for (const auto &[Loc, Stats] : Locs) {
+    if (RecordOffsets) {
+      Vec.push_back({toJSON(Loc), Stats.Count, toJSON(Stats.Offsets)});
+    } else {
+      Vec.push_back({toJSON(Loc), Stats.Count});
+    }
   }
 
   return Vec;
@@ -88,28 +245,364 @@ static json::Value toJSON(const LocationCountMap &Locs) {
 static json::Value toJSON(const DefUseMap &DefUses) {
   std::vector<json::Value> Vec;
 
-  for (const auto &[Def, Locs] : DefUses) {
-    Vec.push_back({toJSON(*Def), toJSON(Locs)});
+  for (const auto &[Def, Entry] : DefUses) {
+    Vec.push_back({json::Array{Def->Var, toJSON(Def->Loc), toJSON(Entry.Stats)},
+                   toJSON(Entry.Uses)});
   }
 
   return Vec;
 }
 
+/// Serialize to the compact binary trace format (see `Trace.h`)
+static void writeBinary(const DefUseMap &DefUses, raw_ostream &OS) {
+  StringMap<uint64_t> StrIdxs;
+  SmallVector<StringRef, 0> Strs;
+
+  const auto getStrIdx = [&](const char *Str) {
+    const auto &[It, Inserted] = StrIdxs.try_emplace(Str, Strs.size());
+    if (Inserted) {
+      Strs.push_back(It->first());
+    }
+    return It->second;
+  };
+
+  // Defs and uses. Strings are interned as they are encountered
+  SmallString<0> Body;
+  raw_svector_ostream BodyOS(Body);
+
+  encodeULEB128(DefUses.size(), BodyOS);
+  for (const auto &[Def, Entry] : DefUses) {
+    encodeULEB128(getStrIdx(Def->Var), BodyOS);
+    encodeULEB128(getStrIdx(Def->Loc.File), BodyOS);
+    encodeULEB128(getStrIdx(Def->Loc.Func), BodyOS);
+    encodeULEB128(Def->Loc.Line, BodyOS);
+    encodeULEB128(Def->Loc.Column, BodyOS);
+    encodeULEB128(Entry.Stats.Instances, BodyOS);
+    encodeULEB128(Entry.Stats.Deregistered, BodyOS);
+
+    encodeULEB128(Entry.Uses.size(), BodyOS);
+    for (const auto &[Loc, Stats] : Entry.Uses) {
+      encodeULEB128(getStrIdx(Loc.SrcLoc->File), BodyOS);
+      encodeULEB128(getStrIdx(Loc.SrcLoc->Func), BodyOS);
+      encodeULEB128(Loc.SrcLoc->Line, BodyOS);
+      encodeULEB128(Loc.SrcLoc->Column, BodyOS);
+      encodeULEB128(Loc.PC, BodyOS);
+      encodeULEB128(Stats.Count, BodyOS);
+      if (RecordOffsets) {
+        encodeULEB128(Stats.Offsets.Min, BodyOS);
+        encodeULEB128(Stats.Offsets.Max, BodyOS);
+        encodeULEB128(Stats.Offsets.Buckets, BodyOS);
+      }
+    }
+  }
+
+  // Header and string table
+  SmallString<0> Out;
+  raw_svector_ostream OutOS(Out);
+
+  OutOS << StringRef(kDUATraceMagic, sizeof(kDUATraceMagic) - 1);
+  encodeULEB128(kDUATraceVersion, OutOS);
+  encodeULEB128(kDUATraceDefCounts | (RecordOffsets ? kDUATraceOffsets : 0),
+                OutOS);
+  encodeULEB128(Strs.size(), OutOS);
+  for (const auto &Str : Strs) {
+    encodeULEB128(Str.size(), OutOS);
+    OutOS << Str;
+  }
+  OutOS << Body;
+
+  OS.write(Out.data(), Out.size());
+}
+
+/// A def, deregistration or use event, for streaming
+struct TraceEvent {
+  enum EventKind : uint8_t { Def, Deregister, Use };
+
+  EventKind Kind;               ///< Event kind
+  const SrcDefinition *DefSite; ///< Def site
+  const SrcLocation *Loc;       ///< Use location
+  uintptr_t PC;                 ///< Use program counter
+  size_t Offset;                ///< Use offset
+};
+
+/// Single-producer single-consumer ring buffer of trace events. The owning
+/// thread pushes events and the writer thread drains them
+class EventRing {
+public:
+  static constexpr size_t kCapacity = 1 << 14;
+
+  /// Push an event, waiting for the consumer if the ring is full. Returns
+  /// `false` (dropping the event) if tracing stops while waiting
+  bool push(const TraceEvent &E, const std::atomic<bool> &Stopped) {
+    const auto H = Head.load(std::memory_order_relaxed);
+    while (unlikely(H - Tail.load(std::memory_order_acquire) == kCapacity)) {
+      if (Stopped.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      sched_yield();
+    }
+    Events[H % kCapacity] = E;
+    Head.store(H + 1, std::memory_order_release);
+    return true;
+  }
+
+  template <typename Fn> void drain(Fn F) {
+    const auto T = Tail.load(std::memory_order_relaxed);
+    const auto H = Head.load(std::memory_order_acquire);
+    for (auto I = T; I != H; ++I) {
+      F(Events[I % kCapacity]);
+    }
+    Tail.store(H, std::memory_order_release);
+  }
+
+private:
+  std::array<TraceEvent, kCapacity> Events;
+  alignas(64) std::atomic<size_t> Head = 0;
+  alignas(64) std::atomic<size_t> Tail = 0;
+};
+
+/// Direct-mapped cache of the (def, use) pairs already recorded by a thread,
+/// used when sampling. A hit means the pair has been recorded. A miss (which
+/// may be due to eviction) falls back to the table
+class SeenCache {
+public:
+  static constexpr unsigned kNumEntriesLog2 = 12;
+
+  bool testAndSet(const SrcDefinition *Def, uintptr_t PC) {
+    auto &E = Entries[hash(Def, PC)];
+    if (likely(E.Def == Def && E.PC == PC)) {
+      return true;
+    }
+    E = {Def, PC};
+    return false;
+  }
+
+  void clear() { Entries.fill({}); }
+
+private:
+  struct Entry {
+    const SrcDefinition *Def = nullptr;
+    uintptr_t PC = 0;
+  };
+
+  static size_t hash(const SrcDefinition *Def, uintptr_t PC) {
+    const uint64_t H = (reinterpret_cast<uintptr_t>(Def) ^ PC) *
+                       UINT64_C(0x9E3779B97F4A7C15);
+    return H >> (64 - kNumEntriesLog2);
+  }
+
+  std::array<Entry, 1 << kNumEntriesLog2> Entries;
+};
+
+/// A use of a def at a particular runtime location
+struct UseCount {
+  const SrcLocation *Loc; ///< Source location
+  UseStats Stats;         ///< Use statistics
+};
+
+/// Per-thread def-use table. Only ever updated by its owning thread, so no
+/// locking is required on the fast path. Tables are merged when serializing.
+///
+/// A thread sets `Busy` while updating its table, and the serializer sets
+/// `Stopped` before merging. This is a Dekker-style handshake, so each side
+/// needs a store-load barrier: the hooks take the cheap side (`lightBarrier`)
+/// and the serializer the expensive side (`heavyBarrier`). A timeout that
+/// interrupts a `Busy` thread is deferred until the thread clears `Busy`.
+///
+/// When streaming, events are instead pushed to a ring buffer that is drained
+/// by the writer thread
+class ThreadLog {
+public:
+  using DefUseKey = std::pair<const SrcDefinition *, uintptr_t>;
+
+  ThreadLog();
+  ThreadLog(const ThreadLog &) = delete;
+  ~ThreadLog();
+
+  void addDef(const SrcDefinition *Def) {
+    if (Ring) {
+      if (likely(!Stopped.load(std::memory_order_relaxed))) {
+        Ring->push({TraceEvent::Def, Def, nullptr, 0, 0}, Stopped);
+      }
+      return;
+    }
+
+    Busy.store(true, std::memory_order_relaxed);
+    lightBarrier();
+    if (likely(!Stopped.load(std::memory_order_relaxed))) {
+      Defs[Def].Instances++;
+    }
+    Busy.store(false, std::memory_order_release);
+    runPendingTimeout();
+  }
+
+  void removeDef(const SrcDefinition *Def) {
+    if (Ring) {
+      if (likely(!Stopped.load(std::memory_order_relaxed))) {
+        Ring->push({TraceEvent::Deregister, Def, nullptr, 0, 0}, Stopped);
+      }
+      return;
+    }
+
+    Busy.store(true, std::memory_order_relaxed);
+    lightBarrier();
+    if (likely(!Stopped.load(std::memory_order_relaxed))) {
+      Defs[Def].Deregistered++;
+    }
+    Busy.store(false, std::memory_order_release);
+    runPendingTimeout();
+  }
+
+  void addUse(const SrcDefinition *Def, const SrcLocation *Loc, uintptr_t PC,
+              size_t Offset) {
+    if (Seen && Seen->testAndSet(Def, PC)) {
+      return;
+    }
+
+    if (Ring) {
+      if (likely(!Stopped.load(std::memory_order_relaxed))) {
+        Ring->push({TraceEvent::Use, Def, Loc, PC, Offset}, Stopped);
+      }
+      return;
+    }
+
+    Busy.store(true, std::memory_order_relaxed);
+    lightBarrier();
+    if (likely(!Stopped.load(std::memory_order_relaxed))) {
+      const auto &[It, Inserted] =
+          Uses.try_emplace({Def, PC}, UseCount{Loc, {}});
+      auto &Use = It->second;
+      if (Inserted || !SampleUses) {
+        Use.Stats.Count++;
+        if (RecordOffsets) {
+          Use.Stats.Offsets.add(Offset);
+        }
+      }
+    }
+    Busy.store(false, std::memory_order_release);
+    runPendingTimeout();
+  }
+
+  /// Merge this thread's table (or drain its ring buffer) into the given
+  /// def-use map
+  void mergeInto(DefUseMap &DefUses) {
+    if (Ring) {
+      Ring->drain([&](const TraceEvent &E) {
+        auto &Entry = DefUses[E.DefSite];
+        switch (E.Kind) {
+        case TraceEvent::Def:
+          Entry.Stats.Instances++;
+          break;
+        case TraceEvent::Deregister:
+          Entry.Stats.Deregistered++;
+          break;
+        case TraceEvent::Use: {
+          auto &Stats = Entry.Uses[RuntimeLocation(E.Loc, E.PC)];
+          if (Stats.Count == 0 || !SampleUses) {
+            Stats.Count++;
+            if (RecordOffsets) {
+              Stats.Offsets.add(E.Offset);
+            }
+          }
+          break;
+        }
+        }
+      });
+      return;
+    }
+
+    for (const auto &[Def, Stats] : Defs) {
+      DefUses[Def].Stats.merge(Stats);
+    }
+    for (const auto &[Key, Use] : Uses) {
+      DefUses[Key.first].Uses[RuntimeLocation(Use.Loc, Key.second)].merge(
+          Use.Stats);
+    }
+  }
+
+  /// Clear the table (e.g., between inputs in persistent mode)
+  void reset() {
+    Defs.clear();
+    Uses.clear();
+    if (Seen) {
+      Seen->clear();
+    }
+  }
+
+  /// Wait until the owning thread is no longer updating the table
+  void wait() const {
+    while (Busy.load(std::memory_order_acquire)) {
+      sched_yield();
+    }
+  }
+
+  bool isBusy() const { return Busy.load(std::memory_order_acquire); }
+
+  /// Stop all threads from updating their tables. A thread either sees
+  /// `Stopped`, or is seen as `Busy` (and waited on)
+  static void stop() {
+    Stopped.store(true, std::memory_order_relaxed);
+    heavyBarrier();
+  }
+
+private:
+  DenseMap<const SrcDefinition *, DefStats> Defs;
+  DenseMap<DefUseKey, UseCount> Uses;
+  std::unique_ptr<EventRing> Ring;
+  std::unique_ptr<SeenCache> Seen;
+  std::atomic<bool> Busy = false;
+
+  static std::atomic<bool> Stopped;
+};
+
+std::atomic<bool> ThreadLog::Stopped = false;
+
 class VarLogger {
 public:
   VarLogger() {
-    std::string OutPath;
+    // The logger is created before any thread's table, so these options are
+    // set before the first def/use is recorded
+    if (const auto *Offsets = getenv("LLVM_PROFILE_OFFSETS")) {
+      RecordOffsets = StringRef(Offsets) != "0";
+    }
+    if (const auto *Sample = getenv("LLVM_PROFILE_SAMPLE")) {
+      SampleUses = StringRef(Sample) != "0";
+    }
+    if (const auto *Live = getenv("LLVM_PROFILE_LIVE")) {
+      TrackLive = StringRef(Live) != "0";
+    }
+
+    // Traces are JSON unless the compact binary format is requested
+    if (const auto *Format = getenv("LLVM_PROFILE_FORMAT")) {
+      WriteJSON = !StringRef(Format).equals_insensitive("binary");
+    }
+
+    // Streamed traces are a sequence of binary trace chunks
+    if (const auto *Stream = getenv("LLVM_PROFILE_STREAM")) {
+      unsigned T;
+      if (to_integer(Stream, T) && T > 0) {
+        StreamInterval = std::chrono::milliseconds(T);
+        WriteJSON = false;
+      }
+    }
+
     raw_string_ostream SS(OutPath);
 
+    // If the target also has source-based coverage, the raw profile is written
+    // to `LLVM_PROFILE_FILE`, so the trace is written alongside it
     if (const auto *Log = getenv("LLVM_PROFILE_FILE")) {
-      SS << Log;
+      SS << Log << (hasSourceCoverage() ? ".trace" : "");
     } else {
-      SS << "dua." << getpid() << ".json";
+      SS << "dua." << getpid() << (WriteJSON ? ".json" : ".trace");
     }
     SS.flush();
 
     std::error_code EC;
     OS.emplace(SS.str(), EC);
+
+    if (isStreaming()) {
+      Writer = std::thread(&VarLogger::stream, this);
+    }
   }
 
   VarLogger(const VarLogger &) = delete;
@@ -120,20 +613,38 @@ public:
     bzero(&It, sizeof(It));
     setitimer(ITIMER_REAL, &It, nullptr);
 
-    // Serialize to JSON
+    // Serialize trace
     serialize();
   }
 
   void serialize() {
+    CriticalSection CS;
+
     // Cancel timer
     struct itimerval It = {};
     setitimer(ITIMER_REAL, &It, nullptr);
 
+    // Stop the writer thread. Any remaining events are drained below
+    if (Writer.joinable()) {
+      StopStreaming.store(true);
+      Writer.join();
+    }
+
+    std::scoped_lock SL(Lock);
+
     if (!OS) {
       return;
     }
 
-    *OS << std::move(toJSON(DefUses));
+    // Merge the tables of all running threads. A timeout is never handled
+    // while the current thread is `Busy`, so this cannot wait on itself
+    ThreadLog::stop();
+    for (auto *T : Threads) {
+      T->wait();
+      T->mergeInto(DefUses);
+    }
+
+    write(*OS);
 
     // Close and cleanup output stream
     OS->flush();
@@ -141,26 +652,110 @@ public:
     OS.reset();
   }
 
-  void addDef(const SrcDefinition *Def, uintptr_t PC) {
-    // XXX Ignore for now
-    (void)PC;
+  /// Write the trace accumulated since the last dump to the given path, and
+  /// reset it. Used to produce one trace per input in persistent mode, so the
+  /// process-wide trace is discarded. All other threads must be quiescent
+  bool dump(const char *Path) {
+    CriticalSection CS;
+
+    if (Writer.joinable()) {
+      StopStreaming.store(true);
+      Writer.join();
+    }
 
     std::scoped_lock SL(Lock);
-    DefUses.emplace(Def, LocationCountMap());
+
+    if (OS) {
+      OS->close();
+      OS.reset();
+      if (sys::fs::is_regular_file(OutPath)) {
+        sys::fs::remove(OutPath);
+      }
+    }
+
+    // May be called on timeout, but never while the current thread is `Busy`
+    for (auto *T : Threads) {
+      T->wait();
+      T->mergeInto(DefUses);
+      T->reset();
+    }
+
+    std::error_code EC;
+    raw_fd_ostream Out(Path, EC);
+    if (!EC) {
+      write(Out);
+      Out.flush();
+    }
+    DefUses.clear();
+
+    return !EC;
   }
 
-  void addUse(const SrcDefinition *Def, ptrdiff_t Offset,
-              const SrcLocation *Loc, uintptr_t PC) {
-    RuntimeLocation RLoc(Loc, PC);
+  bool isStreaming() const { return StreamInterval.hasValue(); }
 
+  void registerThread(ThreadLog *T) {
+    CriticalSection CS;
     std::scoped_lock SL(Lock);
-    DefUses[Def][RLoc]++;
+    Threads.insert(T);
+  }
+
+  /// Merge the table of an exiting thread
+  void deregisterThread(ThreadLog *T) {
+    CriticalSection CS;
+    std::scoped_lock SL(Lock);
+    Threads.erase(T);
+    if (OS) {
+      T->mergeInto(DefUses);
+    }
   }
 
 private:
+  void write(raw_ostream &Out) const {
+    if (WriteJSON) {
+      Out << std::move(toJSON(DefUses));
+    } else {
+      writeBinary(DefUses, Out);
+    }
+  }
+
+  /// Writer thread. Periodically drains the ring buffers of all threads and
+  /// appends the accumulated deltas to the trace
+  void stream() {
+    // The timeout handler must not run on the writer thread (it joins it)
+    sigset_t Mask;
+    sigemptyset(&Mask);
+    sigaddset(&Mask, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &Mask, nullptr);
+
+    auto LastWrite = std::chrono::steady_clock::now();
+    while (!StopStreaming.load(std::memory_order_relaxed)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+      std::scoped_lock SL(Lock);
+      for (auto *T : Threads) {
+        T->mergeInto(DefUses);
+      }
+
+      const auto Now = std::chrono::steady_clock::now();
+      if (Now - LastWrite >= *StreamInterval && !DefUses.empty() && OS) {
+        writeBinary(DefUses, *OS);
+        OS->flush();
+        DefUses.clear();
+        LastWrite = Now;
+      }
+    }
+  }
+
+  std::string OutPath;
   Optional<raw_fd_ostream> OS;
+  bool WriteJSON = true;
   DefUseMap DefUses;
+  SmallPtrSet<ThreadLog *, 16> Threads;
   std::mutex Lock;
+
+  Optional<std::chrono::milliseconds> StreamInterval;
+  std::atomic<bool> StopStreaming = false;
+  std::thread Writer;
 };
 
 static VarLogger &Log() {
@@ -168,12 +763,79 @@ static VarLogger &Log() {
   return L;
 }
 
-static void handleTimeout(int) { Log().serialize(); }
+/// The current thread's table. Unlike `TLog`, safe to read from a signal
+/// handler (it is null if the thread has not traced anything yet)
+static thread_local ThreadLog *CurrentLog = nullptr;
+
+ThreadLog::ThreadLog() {
+  CriticalSection CS;
+
+  auto &L = Log();
+  if (L.isStreaming()) {
+    Ring = std::make_unique<EventRing>();
+  }
+  if (SampleUses) {
+    Seen = std::make_unique<SeenCache>();
+  }
+  L.registerThread(this);
+  CurrentLog = this;
+}
+
+ThreadLog::~ThreadLog() {
+  CurrentLog = nullptr;
+  Log().deregisterThread(this);
+}
+
+static ThreadLog &TLog() {
+  thread_local ThreadLog L;
+  return L;
+}
+
+/// Take a timeout action, unless the interrupted thread is updating its table
+/// or holding the logger's lock. In that case the action is deferred until the
+/// thread is done (otherwise the thread's table could be torn, or the logger's
+/// lock self-deadlock)
+static void handleTimeoutWith(TimeoutAction Action) {
+  if (CriticalDepth > 0 || (CurrentLog && CurrentLog->isBusy())) {
+    PendingTimeout.store(Action);
+    return;
+  }
+  Action();
+}
+
+static void serializeTrace() { Log().serialize(); }
+
+/// Exiting also writes the raw profile (via the LLVMCov runtime's `atexit`
+/// handler). The trace is serialized first, so the exiting thread's table is
+/// not merged again
+static void serializeTraceAndExit() {
+  Log().serialize();
+  exit(0);
+}
+
+static void handleTimeout(int) {
+  handleTimeoutWith(hasSourceCoverage() ? serializeTraceAndExit
+                                        : serializeTrace);
+}
+
+// Start the fork server before any other constructor runs, so each forked child
+// creates its own logger (and reads its own output path)
+__attribute__((constructor(101))) static void __dua_trace_forkserver() {
+  __fuzzalloc_forkserver();
+
+  // Membarrier registration is not inherited by forked children. No other
+  // threads exist yet, so they all observe the result
+  HasMembarrier = syscall(__NR_membarrier,
+                          MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+}
 
 __attribute__((constructor)) static void __dua_trace_initialize_timeout() {
   struct sigaction SA = {};
   struct itimerval It = {};
 
+  // If the target also has source-based coverage, the LLVMCov runtime leaves
+  // the timeout to the tracer. Exiting from the signal handler (as the LLVMCov
+  // runtime does) would merge the interrupted thread's table mid-update
   if (const auto *Timeout = getenv("LLVM_PROFILE_TIMEOUT")) {
     unsigned T;
     if (to_integer(Timeout, T)) {
@@ -193,18 +855,32 @@ __attribute__((constructor)) static void __dua_trace_initialize_timeout() {
 //
 
 extern "C" {
-void __tracer_def(const SrcDefinition *Def) {
-  Log().addDef(Def, (uintptr_t)__builtin_return_address(0));
+void __tracer_def(const SrcDefinition *Def) { TLog().addDef(Def); }
+
+void __bb_deregister_hook(void *Obj, size_t AllocSize) {
+  if (!TrackLive) {
+    return;
+  }
+
+  const auto *Def = *reinterpret_cast<SrcDefinition **>(
+      reinterpret_cast<uintptr_t>(Obj) + AllocSize - sizeof(SrcDefinition *));
+  if (Def) {
+    TLog().removeDef(Def);
+  }
 }
 
+int __tracer_dump(const char *Path) { return Log().dump(Path) ? 0 : -1; }
+
+void __tracer_timeout(void (*Action)(void)) { handleTimeoutWith(Action); }
+
 void __tracer_use(const SrcLocation *Loc, void *Ptr, size_t Size) {
   uintptr_t Base;
   SrcDefinition **Def =
       (SrcDefinition **)__bb_lookup(Ptr, &Base, sizeof(SrcDefinition *));
 
   if (likely(Def != nullptr)) {
-    ptrdiff_t Offset = (uintptr_t)Ptr - Base;
-    Log().addUse(*Def, Offset, Loc, (uintptr_t)__builtin_return_address(0));
+    size_t Offset = (uintptr_t)Ptr - Base;
+    TLog().addUse(*Def, Loc, (uintptr_t)__builtin_return_address(0), Offset);
   }
 }
 }
@@ -0,0 +1,123 @@
+//===-- TracerReplay.cpp - Persistent-mode tracer replay --------*- C++ -*-===//
+///
+/// \file
+/// Replay many inputs through a libFuzzer-style harness (i.e., one that defines
+/// `LLVMFuzzerTestOneInput`) in a single process, writing one def-use trace per
+/// input.
+///
+/// Usage: `<target> [input...]`. If no inputs are given, input paths are read
+/// from stdin (one per line). The trace for each input is written to
+/// `$LLVM_PROFILE_DIR/<input file name>`.
+///
+//===----------------------------------------------------------------------===//
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+
+extern "C" {
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+__attribute__((weak)) int LLVMFuzzerInitialize(int *, char ***);
+int __tracer_dump(const char *);
+void __tracer_timeout(void (*)(void));
+}
+
+namespace {
+//
+// Global variables
+//
+
+static std::string CurrentTrace;
+static unsigned Timeout = 0;
+
+//
+// Helper functions
+//
+
+static void setTimer(unsigned T) {
+  struct itimerval It = {};
+  It.it_value.tv_sec = T / 1000;
+  It.it_value.tv_usec = (T % 1000) * 1000;
+  setitimer(ITIMER_REAL, &It, nullptr);
+}
+
+/// Write the (partial) trace of the input that timed out. The remaining inputs
+/// must be replayed in a new process
+static void dumpAndExit() {
+  __tracer_dump(CurrentTrace.c_str());
+  _exit(1);
+}
+
+/// The tracer defers the dump if the timeout interrupts one of its hooks, so
+/// the hook's update is not lost
+static void handleTimeout(int) { __tracer_timeout(dumpAndExit); }
+
+static void replay(const StringRef &Input, const StringRef &OutDir) {
+  auto BufOrErr = MemoryBuffer::getFile(Input, /*IsText=*/false,
+                                        /*RequiresNullTerminator=*/false);
+  if (const auto &EC = BufOrErr.getError()) {
+    errs() << "Unable to read " << Input << ": " << EC.message() << '\n';
+    return;
+  }
+  const auto &Buf = *BufOrErr;
+
+  SmallString<128> Trace(OutDir);
+  sys::path::append(Trace, sys::path::filename(Input));
+  CurrentTrace = Trace.str().str();
+
+  setTimer(Timeout);
+  LLVMFuzzerTestOneInput(Buf->getBuffer().bytes_begin(), Buf->getBufferSize());
+  setTimer(0);
+
+  if (__tracer_dump(CurrentTrace.c_str()) != 0) {
+    errs() << "Unable to write trace to " << CurrentTrace << '\n';
+  }
+}
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  if (LLVMFuzzerInitialize) {
+    LLVMFuzzerInitialize(&argc, &argv);
+  }
+
+  const auto *Dir = getenv("LLVM_PROFILE_DIR");
+  const StringRef OutDir = Dir ? Dir : ".";
+
+  // The timeout applies per input (rather than to the whole process)
+  setTimer(0);
+  if (const auto *T = getenv("LLVM_PROFILE_TIMEOUT")) {
+    if (to_integer(T, Timeout)) {
+      struct sigaction SA = {};
+      SA.sa_handler = handleTimeout;
+      sigaction(SIGALRM, &SA, nullptr);
+    }
+  }
+
+  if (argc > 1) {
+    for (int I = 1; I < argc; ++I) {
+      replay(argv[I], OutDir);
+    }
+  } else {
+    std::string Input;
+    while (std::getline(std::cin, Input)) {
+      if (!Input.empty()) {
+        replay(Input, OutDir);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -228,6 +228,7 @@ bool GlobalVarTag::runOnModule(Module &M) {
   for (auto *GV : GVDefs) {
     if (ClInstType == InstType::InstAFL) {
       auto *Metadata = generateTag(TagTy);
+      tagMapAddDef(Metadata, SrcVars.lookup(GV));
       tag(GV, Metadata, CtorEntryBB, DtorEntryBB);
     } else if (ClInstType == InstType::InstTrace) {
       const auto &SrcVar = SrcVars.lookup(GV);
@@ -241,6 +242,7 @@ bool GlobalVarTag::runOnModule(Module &M) {
 
   ReturnInst::Create(*Ctx, CtorEntryBB);
   ReturnInst::Create(*Ctx, DtorEntryBB);
+  tagMapWrite(M);
 
   success_stream() << "[" << M.getName()
                    << "] Num. tagged global variables: " << NumTaggedGVs
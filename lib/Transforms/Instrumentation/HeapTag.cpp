@@ -7,11 +7,14 @@
 
 #include <llvm/ADT/Statistic.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/ValueMap.h>
 #include <llvm/Pass.h>
+#include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Debug.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/Transforms/Utils/Cloning.h>
@@ -29,9 +32,24 @@ using namespace llvm;
 #define DEBUG_TYPE "fuzzalloc-tag-heap"
 
 namespace {
+//
+// Command-line options
+//
+
+static cl::opt<unsigned> ClHeapContext(
+    "fuzzalloc-heap-context",
+    cl::desc("Number of calling contexts to mix into heap tags (0 disables "
+             "context sensitivity). Only used with AFL instrumentation"),
+    cl::value_desc("K"), cl::init(0));
+
+//
+// Global variables
+//
+
 static unsigned NumTaggedFuncs = 0;
 static unsigned NumTaggedFuncUsers = 0;
 static unsigned NumTrampolines = 0;
+static unsigned NumContextCallSites = 0;
 } // anonymous namespace
 
 class HeapTag : public ModulePass {
@@ -43,30 +61,37 @@ public:
   virtual bool runOnModule(Module &) override;
 
 private:
-  Function *createTrampoline(const Function *) const;
+  Function *createTrampoline(const Function *);
 
   FunctionType *getTaggedFunctionType(const FunctionType *) const;
   Function *getTaggedFunction(const Function *) const;
   Function *tagFunction(const Function *) const;
-  Instruction *tagCall(CallBase *, FunctionCallee) const;
-  void tagUse(Use *) const;
+  Instruction *tagCall(CallBase *, FunctionCallee);
+  void tagUse(Use *);
   void doAFLTag(MemFuncIdentify::DynamicMemoryFunctions &);
 
+  Value *getAllocContext(Function *);
+  Value *mixAllocContext(Value *, Function *, IRBuilder<> &);
+  void updateAllocContext(Function *);
+
   Module *Mod;
   LLVMContext *Ctx;
   IntegerType *TagTy;
   IntegerType *IntPtrTy;
 
   Function *ReturnAddrFn;
+  GlobalVariable *AllocCtx;
 
   SmallPtrSet<Function *, 8> TaggedFuncs;
   ValueMap</* Original function */ Function *, /* Tagged function */ Function *>
       TaggedFuncMap;
+  ValueMap</* Function */ Function *, /* Context on entry */ Value *>
+      AllocCtxMap;
 };
 
 char HeapTag::ID = 0;
 
-Function *HeapTag::createTrampoline(const Function *OrigF) const {
+Function *HeapTag::createTrampoline(const Function *OrigF) {
   const auto &TrampolineName = "fuzzalloc.trampoline." + OrigF->getName().str();
   auto *TrampolineFn = Mod->getFunction(TrampolineName);
   if (TrampolineFn) {
@@ -85,9 +110,12 @@ Function *HeapTag::createTrampoline(const Function *OrigF) const {
   // site tag
   auto *MaxTag = ConstantInt::get(TagTy, kFuzzallocTagMax);
   auto *RetAddr = IRB.CreateCall(ReturnAddrFn, IRB.getInt32(0));
-  auto *Tag = IRB.CreateURem(
+  Value *Tag = IRB.CreateURem(
       IRB.CreateZExtOrTrunc(IRB.CreatePtrToInt(RetAddr, IntPtrTy), TagTy),
       MaxTag);
+  if (AllocCtx) {
+    Tag = mixAllocContext(Tag, TrampolineFn, IRB);
+  }
 
   // Call a tagged version of the dynamic memory allocation function and return
   // its result
@@ -175,20 +203,30 @@ Function *HeapTag::tagFunction(const Function *OrigF) const {
   return TaggedF;
 }
 
-Instruction *HeapTag::tagCall(CallBase *CB, FunctionCallee TaggedF) const {
+Instruction *HeapTag::tagCall(CallBase *CB, FunctionCallee TaggedF) {
   LLVM_DEBUG(dbgs() << "tagging call " << *CB << " (in function "
                     << CB->getFunction()->getName() << ")\n");
 
   // The tag values depends on where the function call _is_. If the (tagged)
   // function is being called from within another tagged function, then just
   // pass the first argument (which is always the tag) straight through.
-  // Otherwise, generate a new tag
+  // Otherwise, generate a new tag (mixing in the allocation context, if
+  // enabled)
   auto *Tag = [&]() -> Value * {
     auto *ParentF = CB->getFunction();
     if (TaggedFuncs.count(ParentF) > 0) {
       return ParentF->arg_begin();
     }
-    return generateTag(TagTy);
+
+    auto *SiteTag = generateTag(TagTy);
+    const auto *Callee = CB->getCalledOperand()->stripPointerCasts();
+    tagMapAddDef(SiteTag, Callee->getName(), CB,
+                 AllocCtx ? ClHeapContext : 0);
+    if (AllocCtx) {
+      IRBuilder<> IRB(CB);
+      return mixAllocContext(SiteTag, ParentF, IRB);
+    }
+    return SiteTag;
   }();
 
   // Make the tag the first argument and copy the original call's arguments
@@ -232,7 +270,7 @@ Instruction *HeapTag::tagCall(CallBase *CB, FunctionCallee TaggedF) const {
 }
 
 /// Replace the use of a memory allocation function with the tagged version
-void HeapTag::tagUse(Use *U) const {
+void HeapTag::tagUse(Use *U) {
   auto *User = U->getUser();
   auto *Fn = dyn_cast<Function>(U->get());
   assert(Fn && "Use must be a function");
@@ -305,6 +343,82 @@ void HeapTag::tagUse(Use *U) const {
   NumTaggedFuncUsers++;
 }
 
+/// Get the allocation context on entry to the given function. The context is
+/// loaded once (at function entry) and reused by every allocation and call
+/// site in the function
+Value *HeapTag::getAllocContext(Function *F) {
+  if (auto *EntryCtx = AllocCtxMap.lookup(F)) {
+    return EntryCtx;
+  }
+
+  IRBuilder<> IRB(&*F->getEntryBlock().getFirstInsertionPt());
+  auto *Load = IRB.CreateLoad(TagTy, AllocCtx, "fuzzalloc.alloc_ctx");
+  Load->setMetadata(Mod->getMDKindID(kFuzzallocNoInstrumentMD),
+                    MDNode::get(*Ctx, None));
+  Load->setMetadata(Mod->getMDKindID(kNoSanitizeMD), MDNode::get(*Ctx, None));
+
+  AllocCtxMap.insert({F, Load});
+  return Load;
+}
+
+/// Mix the allocation context (on entry to the given function) into a tag. The
+/// result may be zero, which would make the allocation look untagged, so zero
+/// is remapped to one. It may also collide with another allocation site's tag
+Value *HeapTag::mixAllocContext(Value *Tag, Function *F, IRBuilder<> &IRB) {
+  auto *Mixed = IRB.CreateXor(Tag, getAllocContext(F));
+  auto *IsDefault =
+      IRB.CreateICmpEQ(Mixed, ConstantInt::get(TagTy, kFuzzallocDefaultTag));
+  return IRB.CreateOr(Mixed, IRB.CreateZExt(IsDefault, TagTy));
+}
+
+/// Update the allocation context before each call site in the given function.
+///
+/// The context is a k-level hash of call sites: the caller's context is
+/// shifted left by `kNumTagBits / k` bits (so that contexts older than `k`
+/// calls are shifted out) and combined with a random call site identifier.
+/// Because every call site recomputes the callee's context from the context on
+/// entry to this function, the context never needs to be restored after a call
+/// returns
+void HeapTag::updateAllocContext(Function *F) {
+  const unsigned Shift = kNumTagBits / ClHeapContext;
+
+  SmallVector<CallBase *, 16> CallSites;
+  for (auto &I : instructions(F)) {
+    auto *CB = dyn_cast<CallBase>(&I);
+    if (!CB || isa<IntrinsicInst>(CB) || CB->isInlineAsm() ||
+        CB->hasMetadata(kFuzzallocTagVarMD)) {
+      continue;
+    }
+
+    // External functions cannot (directly) reach a tagged allocation site
+    const auto *Callee = CB->getCalledFunction();
+    if (Callee && Callee->isDeclaration() && !TaggedFuncs.count(Callee)) {
+      continue;
+    }
+
+    CallSites.push_back(CB);
+  }
+
+  if (CallSites.empty()) {
+    return;
+  }
+
+  auto *EntryCtx = getAllocContext(F);
+  for (auto *CB : CallSites) {
+    IRBuilder<> IRB(CB);
+    auto *CalleeCtx =
+        Shift < kNumTagBits
+            ? IRB.CreateXor(IRB.CreateShl(EntryCtx, Shift), generateTag(TagTy))
+            : static_cast<Value *>(generateTag(TagTy));
+    auto *Store = IRB.CreateStore(CalleeCtx, AllocCtx);
+    Store->setMetadata(Mod->getMDKindID(kFuzzallocNoInstrumentMD),
+                       MDNode::get(*Ctx, None));
+    Store->setMetadata(Mod->getMDKindID(kNoSanitizeMD),
+                       MDNode::get(*Ctx, None));
+    NumContextCallSites++;
+  }
+}
+
 void HeapTag::doAFLTag(MemFuncIdentify::DynamicMemoryFunctions &MemFuncs) {
   // Create the tagged memory allocation functions. These functions take the
   // same arguments as the original dynamic memory allocation function, except
@@ -352,6 +466,18 @@ void HeapTag::doAFLTag(MemFuncIdentify::DynamicMemoryFunctions &MemFuncs) {
       FreeF->eraseFromParent();
     }
   }
+
+  // Propagate the allocation context through the call graph. Tagged functions
+  // pass their tag straight through, so they do not need a context
+  if (AllocCtx) {
+    for (auto &F : *Mod) {
+      if (F.isDeclaration() || TaggedFuncs.count(&F) > 0 ||
+          F.getName().startswith("fuzzalloc.")) {
+        continue;
+      }
+      updateAllocContext(&F);
+    }
+  }
 }
 
 void HeapTag::getAnalysisUsage(AnalysisUsage &AU) const {
@@ -371,9 +497,30 @@ bool HeapTag::runOnModule(Module &M) {
   this->TagTy = Type::getIntNTy(*Ctx, kNumTagBits);
   this->IntPtrTy = Mod->getDataLayout().getIntPtrType(*Ctx);
   this->ReturnAddrFn = Intrinsic::getDeclaration(Mod, Intrinsic::returnaddress);
+  this->AllocCtx = nullptr;
+
+  if (ClHeapContext > kNumTagBits) {
+    report_fatal_error("fuzzalloc heap context must be at most " +
+                       Twine(kNumTagBits));
+  }
+
+  if (ClInstType == InstType::InstAFL && ClHeapContext > 0) {
+    // The allocation context is defined (thread-local) in the runtime
+    this->AllocCtx = cast<GlobalVariable>(
+        Mod->getOrInsertGlobal("__bb_alloc_ctx", TagTy, [&]() {
+          return new GlobalVariable(
+              *Mod, TagTy, /*isConstant=*/false, GlobalValue::ExternalLinkage,
+              /*Initializer=*/nullptr, "__bb_alloc_ctx",
+              /*InsertBefore=*/nullptr, GlobalValue::InitialExecTLSModel);
+        }));
+    status_stream() << "[" << M.getName()
+                    << "] Heap allocation context depth: " << ClHeapContext
+                    << '\n';
+  }
 
   if (ClInstType == InstType::InstAFL) {
     doAFLTag(MemFuncs);
+    tagMapWrite(M);
   } else {
     for (auto *F : MemFuncs) {
       // Tag the function as a memory allocation routine
@@ -404,6 +551,11 @@ bool HeapTag::runOnModule(Module &M) {
   success_stream() << "[" << M.getName()
                    << "] Num. memory func. trampolines: " << NumTrampolines
                    << '\n';
+  if (AllocCtx) {
+    success_stream() << "[" << M.getName()
+                     << "] Num. allocation context call sites: "
+                     << NumContextCallSites << '\n';
+  }
 
   return true;
 }
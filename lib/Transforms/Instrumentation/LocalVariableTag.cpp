@@ -276,6 +276,7 @@ bool LocalVarTag::runOnModule(Module &M) {
   for (auto *Alloca : AllocaDefs) {
     if (ClInstType == InstType::InstAFL) {
       auto *Metadata = generateTag(TagTy);
+      tagMapAddDef(Metadata, SrcVars.lookup(Alloca));
       tag(Alloca, Metadata);
     } else if (ClInstType == InstType::InstTrace) {
       const auto &SrcVar = SrcVars.lookup(Alloca);
@@ -286,6 +287,7 @@ bool LocalVarTag::runOnModule(Module &M) {
                           MDNode::get(*Ctx, None));
     }
   }
+  tagMapWrite(M);
 
   success_stream() << "[" << M.getName()
                    << "] Num. tagged local variables: " << NumTaggedLocals
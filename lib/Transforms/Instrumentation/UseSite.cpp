@@ -52,6 +52,22 @@ static cl::opt<UseSiteCapture> ClUseCapture(
 
 static unsigned NumInstrumentedReads = 0;
 static unsigned NumInstrumentedWrites = 0;
+
+//
+// Helper functions
+//
+
+static StringRef getUseCaptureName(UseSiteCapture Capture) {
+  switch (Capture) {
+  case UseSiteCapture::UseOnly:
+    return "use";
+  case UseSiteCapture::UseWithOffset:
+    return "offset";
+  case UseSiteCapture::UseWithValue:
+    return "value";
+  }
+  llvm_unreachable("Invalid use site capture");
+}
 } // anonymous namespace
 
 /// Instrument use sites
@@ -107,6 +123,7 @@ void UseSite::doInstrument(InterestingMemoryOperand *Op) {
 
   if (ClInstType == InstType::InstAFL) {
     auto *Metadata = generateTag(TagTy);
+    tagMapAddUse(Metadata, Inst, getUseCaptureName(ClUseCapture));
     IRB.CreateCall(InstFn, {Metadata, PtrCast, Size});
   } else if (ClInstType == InstType::InstTrace) {
     auto *Metadata = ConstantExpr::getPointerCast(
@@ -183,18 +200,11 @@ bool UseSite::runOnModule(Module &M) {
     }
     Changed = true;
   }
+  tagMapWrite(M);
 
-  status_stream() << "[" << M.getName() << "] Use site capture: " << [&]() {
-    switch (ClUseCapture) {
-    case UseSiteCapture::UseOnly:
-      return "use";
-    case UseSiteCapture::UseWithOffset:
-      return "offset";
-    case UseSiteCapture::UseWithValue:
-      return "value";
-    }
-    llvm_unreachable("Invalid use site capture");
-  }() << '\n';
+  status_stream() << "[" << M.getName()
+                  << "] Use site capture: " << getUseCaptureName(ClUseCapture)
+                  << '\n';
   success_stream() << "[" << M.getName()
                    << "] Num. instrumented reads: " << NumInstrumentedReads
                    << '\n';
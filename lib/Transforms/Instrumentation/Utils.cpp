@@ -13,9 +13,13 @@
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
 
 #include "fuzzalloc/Metadata.h"
 #include "fuzzalloc/Runtime/BaggyBounds.h"
+#include "fuzzalloc/Streams.h"
 #include "fuzzalloc/fuzzalloc.h"
 
 #include "Utils.h"
@@ -34,6 +38,15 @@ cl::opt<InstType> ClInstType(
                clEnumValN(InstType::InstTrace, "fuzzalloc-inst-tracer",
                           "Tracer instrumentation")));
 
+static cl::opt<std::string>
+    ClTagMap("fuzzalloc-tag-map",
+             cl::desc("Append def/use site tags (and their source locations) "
+                      "to the given tag map (AFL instrumentation only)"),
+             cl::value_desc("path"));
+
+/// Tag map records not yet written
+static std::string TagMapBuf;
+
 ConstantInt *generateTag(IntegerType *TagTy) {
   return ConstantInt::get(
       TagTy, static_cast<uint64_t>(RAND(kFuzzallocTagMin, kFuzzallocTagMax)));
@@ -254,3 +267,98 @@ Constant *tracerCreateUse(Instruction *I, Module *M) {
                                   {FilenamePtr, FuncNamePtr, Line, Col});
   return createTracerGlobalVariable(Use, M);
 }
+
+//
+// Tag map functionality
+//
+
+/// Source location of an instruction, as `[file, func, line, col]`
+static json::Array getSrcLocation(const Instruction *I) {
+  const auto &Loc = I->getDebugLoc();
+  if (!Loc) {
+    return json::Array{"", "", 0, 0};
+  }
+
+  auto *SP = getDISubprogram(Loc.getScope());
+  return json::Array{SP->getFile()->getFilename(), SP->getName(),
+                     Loc.getLine(), Loc.getCol()};
+}
+
+static void tagMapAdd(json::Object Record) {
+  raw_string_ostream OS(TagMapBuf);
+  OS << json::Value(std::move(Record)) << '\n';
+}
+
+void tagMapAddDef(const ConstantInt *Tag, const VarInfo &SrcVar) {
+  if (ClTagMap.empty()) {
+    return;
+  }
+
+  const auto *DIVar = SrcVar.getDbgVar();
+  const auto *Loc = SrcVar.getLoc();
+  if (!DIVar) {
+    tagMapAdd(json::Object{{"def", Tag->getZExtValue()},
+                           {"var", ""},
+                           {"loc", json::Array{"", "", 0, 0}}});
+    return;
+  }
+
+  const auto &FuncName = [&]() -> StringRef {
+    if (auto *DILocal = dyn_cast<DILocalVariable>(DIVar)) {
+      return getDISubprogram(DILocal->getScope())->getName();
+    }
+    return "";
+  }();
+
+  tagMapAdd(json::Object{{"def", Tag->getZExtValue()},
+                         {"var", DIVar->getName()},
+                         {"loc", json::Array{DIVar->getFilename(), FuncName,
+                                             DIVar->getLine(),
+                                             Loc ? Loc->getCol() : 0}}});
+}
+
+void tagMapAddDef(const ConstantInt *Tag, const StringRef &Var,
+                  const Instruction *I, unsigned Context) {
+  if (ClTagMap.empty()) {
+    return;
+  }
+
+  json::Object Record{{"def", Tag->getZExtValue()},
+                      {"var", Var},
+                      {"loc", getSrcLocation(I)}};
+  if (Context > 0) {
+    Record["context"] = Context;
+  }
+  tagMapAdd(std::move(Record));
+}
+
+void tagMapAddUse(const ConstantInt *Tag, const Instruction *I,
+                  const StringRef &Capture) {
+  if (ClTagMap.empty()) {
+    return;
+  }
+
+  tagMapAdd(json::Object{{"use", Tag->getZExtValue()},
+                         {"capture", Capture},
+                         {"loc", getSrcLocation(I)}});
+}
+
+void tagMapWrite(const Module &M) {
+  if (ClTagMap.empty() || TagMapBuf.empty()) {
+    return;
+  }
+
+  // Modules may be compiled in parallel, so append all of this module's
+  // records in a single (unbuffered) write
+  std::error_code EC;
+  raw_fd_ostream OS(ClTagMap, EC, sys::fs::OF_Append | sys::fs::OF_Text);
+  if (EC) {
+    error_stream() << "[" << M.getName() << "] Unable to open tag map "
+                   << ClTagMap << ": " << EC.message() << '\n';
+  } else {
+    OS.SetUnbuffered();
+    OS << TagMapBuf;
+  }
+
+  TagMapBuf.clear();
+}
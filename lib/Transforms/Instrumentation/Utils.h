@@ -19,6 +19,7 @@ class DIVariable;
 class Instruction;
 class IntegerType;
 class Module;
+class StringRef;
 class Type;
 class TypeSize;
 class Value;
@@ -61,4 +62,25 @@ llvm::Constant *tracerCreateDef(const VarInfo &, llvm::Module *);
 /// Create a constant `SrcLocation` struct for tracing variable uses
 llvm::Constant *tracerCreateUse(llvm::Instruction *, llvm::Module *);
 
+//
+// Tag map functionality
+//
+
+/// Record the tag assigned to a def site (a global or local variable)
+void tagMapAddDef(const llvm::ConstantInt *, const VarInfo &);
+
+/// Record the tag assigned to a def site (a dynamic memory allocation call).
+/// A non-zero context depth means the tag is mixed with the allocation
+/// context at runtime
+void tagMapAddDef(const llvm::ConstantInt *, const llvm::StringRef &,
+                  const llvm::Instruction *, unsigned = 0);
+
+/// Record the tag assigned to a use site, and what the use site captures
+/// (`use`, `offset`, or `value`) when hashed into the coverage map
+void tagMapAddUse(const llvm::ConstantInt *, const llvm::Instruction *,
+                  const llvm::StringRef &);
+
+/// Append the recorded tags to the tag map (if enabled)
+void tagMapWrite(const llvm::Module &);
+
 #endif // UTILS_H
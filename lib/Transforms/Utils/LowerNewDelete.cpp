@@ -40,14 +40,55 @@ static bool isNewFn(const Function *F, const TargetLibraryInfo *TLI) {
     return false;
   }
 
-  if (TLIFn == LibFunc_Znwj || TLIFn == LibFunc_ZnwjRKSt9nothrow_t ||
-      TLIFn == LibFunc_Znwm || TLIFn == LibFunc_ZnwmRKSt9nothrow_t ||
-      TLIFn == LibFunc_Znaj || TLIFn == LibFunc_ZnajRKSt9nothrow_t ||
-      TLIFn == LibFunc_Znam || TLIFn == LibFunc_ZnamRKSt9nothrow_t) {
+  switch (TLIFn) {
+  // new(unsigned int)
+  case LibFunc_Znwj:
+  case LibFunc_ZnwjRKSt9nothrow_t:
+  case LibFunc_ZnwjSt11align_val_t:
+  case LibFunc_ZnwjSt11align_val_tRKSt9nothrow_t:
+  // new(unsigned long)
+  case LibFunc_Znwm:
+  case LibFunc_ZnwmRKSt9nothrow_t:
+  case LibFunc_ZnwmSt11align_val_t:
+  case LibFunc_ZnwmSt11align_val_tRKSt9nothrow_t:
+  // new[](unsigned int)
+  case LibFunc_Znaj:
+  case LibFunc_ZnajRKSt9nothrow_t:
+  case LibFunc_ZnajSt11align_val_t:
+  case LibFunc_ZnajSt11align_val_tRKSt9nothrow_t:
+  // new[](unsigned long)
+  case LibFunc_Znam:
+  case LibFunc_ZnamRKSt9nothrow_t:
+  case LibFunc_ZnamSt11align_val_t:
+  case LibFunc_ZnamSt11align_val_tRKSt9nothrow_t:
     return true;
+  default:
+    return false;
+  }
+}
+
+/// Returns `true` if the given `new` function takes a `std::align_val_t`
+/// argument (always the second argument)
+static bool isAlignedNewFn(const Function *F, const TargetLibraryInfo *TLI) {
+  StringRef FnName = F->getName();
+  LibFunc TLIFn;
+  if (!TLI || !TLI->getLibFunc(FnName, TLIFn) || !TLI->has(TLIFn)) {
+    return false;
   }
 
-  return false;
+  switch (TLIFn) {
+  case LibFunc_ZnwjSt11align_val_t:
+  case LibFunc_ZnwjSt11align_val_tRKSt9nothrow_t:
+  case LibFunc_ZnwmSt11align_val_t:
+  case LibFunc_ZnwmSt11align_val_tRKSt9nothrow_t:
+  case LibFunc_ZnajSt11align_val_t:
+  case LibFunc_ZnajSt11align_val_tRKSt9nothrow_t:
+  case LibFunc_ZnamSt11align_val_t:
+  case LibFunc_ZnamSt11align_val_tRKSt9nothrow_t:
+    return true;
+  default:
+    return false;
+  }
 }
 
 static bool isDeleteFn(const Function *F, const TargetLibraryInfo *TLI) {
@@ -57,11 +98,31 @@ static bool isDeleteFn(const Function *F, const TargetLibraryInfo *TLI) {
     return false;
   }
 
-  if (TLIFn == LibFunc_ZdlPv || TLIFn == LibFunc_ZdaPv) {
+  switch (TLIFn) {
+  // delete(void*)
+  case LibFunc_ZdlPv:
+  case LibFunc_ZdlPvRKSt9nothrow_t:
+  case LibFunc_ZdlPvSt11align_val_t:
+  case LibFunc_ZdlPvSt11align_val_tRKSt9nothrow_t:
+  // delete(void*, size_t)
+  case LibFunc_ZdlPvj:
+  case LibFunc_ZdlPvjSt11align_val_t:
+  case LibFunc_ZdlPvm:
+  case LibFunc_ZdlPvmSt11align_val_t:
+  // delete[](void*)
+  case LibFunc_ZdaPv:
+  case LibFunc_ZdaPvRKSt9nothrow_t:
+  case LibFunc_ZdaPvSt11align_val_t:
+  case LibFunc_ZdaPvSt11align_val_tRKSt9nothrow_t:
+  // delete[](void*, size_t)
+  case LibFunc_ZdaPvj:
+  case LibFunc_ZdaPvjSt11align_val_t:
+  case LibFunc_ZdaPvm:
+  case LibFunc_ZdaPvmSt11align_val_t:
     return true;
+  default:
+    return false;
   }
-
-  return false;
 }
 
 static CallInst *lowerInvoke(InvokeInst *Invoke) {
@@ -92,19 +153,20 @@ public:
   virtual bool runOnModule(Module &) override;
 
 private:
-  void lowerNew(User *, Function *) const;
+  void lowerNew(User *, Function *, bool) const;
   void lowerDelete(User *, Function *) const;
 
   Module *Mod;
   LLVMContext *Ctx;
 
   Function *MallocFn;
+  Function *AlignedAllocFn;
   Function *FreeFn;
 };
 
 char LowerNewDelete::ID = 0;
 
-void LowerNewDelete::lowerNew(User *U, Function *NewFn) const {
+void LowerNewDelete::lowerNew(User *U, Function *NewFn, bool IsAligned) const {
   LLVM_DEBUG(dbgs() << "rewriting new call " << *U << '\n');
 
   // Lower invoke to call, as we don't deal with `new`'s exceptions anyway
@@ -114,9 +176,26 @@ void LowerNewDelete::lowerNew(User *U, Function *NewFn) const {
 
   if (auto *CB = dyn_cast<CallBase>(U)) {
     auto *AllocSize = CB->getArgOperand(0);
-    auto *Malloc = CallInst::CreateMalloc(
-        CB, AllocSize->getType(), CB->getType()->getPointerElementType(),
-        AllocSize, nullptr, nullptr);
+    auto *Malloc = [&]() -> Instruction * {
+      if (!IsAligned) {
+        return CallInst::CreateMalloc(CB, AllocSize->getType(),
+                                      CB->getType()->getPointerElementType(),
+                                      AllocSize, nullptr, nullptr);
+      }
+
+      // Aligned `new` takes the alignment as the second argument. Keep the
+      // alignment by lowering to `aligned_alloc`
+      auto *IntPtrTy = AlignedAllocFn->getFunctionType()->getParamType(0);
+      auto *Align = CastInst::CreateZExtOrBitCast(CB->getArgOperand(1),
+                                                  IntPtrTy, "", CB);
+      auto *Size = CastInst::CreateZExtOrBitCast(AllocSize, IntPtrTy, "", CB);
+      auto *AlignedAlloc =
+          CallInst::Create(AlignedAllocFn, {Align, Size}, "", CB);
+      if (AlignedAlloc->getType() == CB->getType()) {
+        return AlignedAlloc;
+      }
+      return new BitCastInst(AlignedAlloc, CB->getType(), "", CB);
+    }();
     Malloc->takeName(CB);
     Malloc->setDebugLoc(CB->getDebugLoc());
     Malloc->copyMetadata(*CB);
@@ -125,14 +204,20 @@ void LowerNewDelete::lowerNew(User *U, Function *NewFn) const {
 
     if (auto *MallocCall = dyn_cast<CallBase>(Malloc)) {
       MallocCall->setCallingConv(CB->getCallingConv());
-      MallocCall->setAttributes(CB->getAttributes());
+      if (!IsAligned) {
+        MallocCall->setAttributes(CB->getAttributes());
+      }
     }
 
     CB->replaceAllUsesWith(Malloc);
     CB->eraseFromParent();
     NumLoweredNews++;
-  } else {
+  } else if (NewFn->getFunctionType() == MallocFn->getFunctionType()) {
     U->replaceUsesOfWith(NewFn, MallocFn);
+  } else {
+    // Non-call uses of the other `new` variants (e.g., aligned/nothrow `new`
+    // used as a function pointer) have no `malloc` equivalent
+    LLVM_DEBUG(dbgs() << "unable to lower new user " << *U << '\n');
   }
 }
 
@@ -145,7 +230,9 @@ void LowerNewDelete::lowerDelete(User *U, Function *DeleteFn) const {
   }
 
   if (auto *CB = dyn_cast<CallBase>(U)) {
-    auto *Ptr = CB->getArgOperand(CB->arg_size() - 1);
+    // The pointer is always the first argument. Any size, alignment, or
+    // `nothrow` arguments are not required by `free`
+    auto *Ptr = CB->getArgOperand(0);
 
     auto *Free = CallInst::CreateFree(Ptr, CB);
     Free->takeName(CB);
@@ -156,15 +243,20 @@ void LowerNewDelete::lowerDelete(User *U, Function *DeleteFn) const {
 
     if (auto *FreeCall = dyn_cast<CallBase>(Free)) {
       FreeCall->setCallingConv(CB->getCallingConv());
-      FreeCall->setAttributes(CB->getAttributes());
+      if (CB->arg_size() == 1) {
+        FreeCall->setAttributes(CB->getAttributes());
+      }
     }
 
     CB->replaceAllUsesWith(Free);
     CB->eraseFromParent();
 
     NumLoweredDeletes++;
-  } else {
+  } else if (DeleteFn->getFunctionType() == FreeFn->getFunctionType()) {
     U->replaceUsesOfWith(DeleteFn, FreeFn);
+  } else {
+    // Non-call uses of sized/aligned `delete` have no `free` equivalent
+    LLVM_DEBUG(dbgs() << "unable to lower delete user " << *U << '\n');
   }
 }
 
@@ -187,6 +279,12 @@ bool LowerNewDelete::runOnModule(Module &M) {
            "Unable to get malloc function");
     this->MallocFn = cast<Function>(Malloc.getCallee());
 
+    auto AlignedAlloc = M.getOrInsertFunction("aligned_alloc", Int8PtrTy,
+                                              IntPtrTy, IntPtrTy);
+    assert(AlignedAlloc && isa<Function>(AlignedAlloc.getCallee()) &&
+           "Unable to get aligned_alloc function");
+    this->AlignedAllocFn = cast<Function>(AlignedAlloc.getCallee());
+
     auto Free = M.getOrInsertFunction("free", Type::getVoidTy(*Ctx), Int8PtrTy);
     assert(Free && isa<Function>(Free.getCallee()) &&
            "Unable to get free function");
@@ -204,9 +302,12 @@ bool LowerNewDelete::runOnModule(Module &M) {
 
   // Lower calls to `new`
   for (auto *F : NewFns) {
+    const auto TLI = getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(*F);
+    const auto IsAligned = isAlignedNewFn(F, &TLI);
+
     SmallVector<User *, 16> Users(F->users());
     for (auto *U : Users) {
-      lowerNew(U, F);
+      lowerNew(U, F, IsAligned);
       Changed = true;
     }
   }
@@ -5,13 +5,34 @@
 ///
 //===----------------------------------------------------------------------===//
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/NativeFormatting.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/Program.h>
 #include <llvm/Support/ThreadPool.h>
 #include <llvm/Support/Threading.h>
 
+#include "fuzzalloc/Runtime/ForkServer.h"
+#include "fuzzalloc/Streams.h"
+
 #include "CovJSONCommon.h"
 
 using namespace llvm;
@@ -21,6 +42,423 @@ static int64_t clamp_uint64_to_int64(uint64_t u) {
   return std::min(u,
                   static_cast<uint64_t>(std::numeric_limits<int64_t>::max()));
 }
+
+static bool readAll(int Fd, void *Buf, size_t Len) {
+  auto *P = static_cast<char *>(Buf);
+  while (Len > 0) {
+    const auto N = read(Fd, P, Len);
+    if (N <= 0) {
+      return false;
+    }
+    P += N;
+    Len -= N;
+  }
+  return true;
+}
+
+static bool writeAll(int Fd, const void *Buf, size_t Len) {
+  const auto *P = static_cast<const char *>(Buf);
+  while (Len > 0) {
+    const auto N = write(Fd, P, Len);
+    if (N <= 0) {
+      return false;
+    }
+    P += N;
+    Len -= N;
+  }
+  return true;
+}
+
+/// Hash a file's contents
+static Expected<std::string> hashFile(const StringRef &Path, MD5 &Hash) {
+  auto BufOrErr = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                        /*RequiresNullTerminator=*/false);
+  if (const auto &EC = BufOrErr.getError()) {
+    return errorCodeToError(EC);
+  }
+  Hash.update(BufOrErr.get()->getBuffer());
+
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  return Result.digest().str().str();
+}
+
+/// Deduplicate testcases across queues by content. Each unique testcase is
+/// linked into the given directory (named by its content hash)
+static Expected<std::vector<Trial>> dedupQueues(
+    const ArrayRef<std::string> &QueueDirs, ///< Queue directories
+    const StringRef &UniqueDir ///< Directory storing unique testcases
+) {
+  std::vector<Trial> Trials;
+  Trials.reserve(QueueDirs.size());
+  StringSet<> Unique;
+
+  for (const auto &QueueDir : QueueDirs) {
+    auto TestcasesOrErr = getTestcases(QueueDir);
+    if (auto E = TestcasesOrErr.takeError()) {
+      return std::move(E);
+    }
+
+    auto &T = Trials.emplace_back();
+    T.QueueDir = QueueDir;
+
+    for (const auto &Testcase : *TestcasesOrErr) {
+      if (!sys::fs::is_regular_file(Testcase)) {
+        continue;
+      }
+
+      MD5 Hash;
+      auto KeyOrErr = hashFile(Testcase, Hash);
+      if (auto E = KeyOrErr.takeError()) {
+        return std::move(E);
+      }
+
+      if (Unique.insert(*KeyOrErr).second) {
+        SmallString<128> AbsTestcase(Testcase);
+        sys::fs::make_absolute(AbsTestcase);
+        SmallString<32> Link(UniqueDir);
+        sys::path::append(Link, *KeyOrErr);
+        if (const auto EC = sys::fs::create_link(AbsTestcase, Link)) {
+          return errorCodeToError(EC);
+        }
+      }
+
+      T.Testcases.push_back(sys::path::filename(Testcase).str());
+      T.Hashes.push_back(std::move(*KeyOrErr));
+    }
+  }
+
+  return Trials;
+}
+
+/// A target running the coverage runtime's fork server
+class ForkServer {
+public:
+  ForkServer(const ForkServer &) = delete;
+
+  ~ForkServer() {
+    // Closing the control pipe stops the server
+    close(CtlFd);
+    close(StatusFd);
+    waitpid(Pid, nullptr, 0);
+  }
+
+  /// Start the target and wait for the fork server handshake
+  static Expected<std::unique_ptr<ForkServer>>
+  start(const ArrayRef<std::string> &Args, const ArrayRef<std::string> &Env) {
+    // Build everything before forking (only async-signal-safe functions may be
+    // called in the child of a multithreaded process)
+    SmallVector<char *, 16> Argv;
+    for (const auto &A : Args) {
+      Argv.push_back(const_cast<char *>(A.c_str()));
+    }
+    Argv.push_back(nullptr);
+
+    SmallVector<char *, 64> Envp;
+    for (const auto &E : Env) {
+      Envp.push_back(const_cast<char *>(E.c_str()));
+    }
+    Envp.push_back(nullptr);
+
+    int CtlPipe[2], StatusPipe[2];
+    if (pipe2(CtlPipe, O_CLOEXEC) != 0) {
+      return errorCodeToError(std::error_code(errno, std::generic_category()));
+    }
+    if (pipe2(StatusPipe, O_CLOEXEC) != 0) {
+      close(CtlPipe[0]);
+      close(CtlPipe[1]);
+      return errorCodeToError(std::error_code(errno, std::generic_category()));
+    }
+
+    const auto Pid = fork();
+    if (Pid < 0) {
+      return errorCodeToError(std::error_code(errno, std::generic_category()));
+    }
+
+    // Run target. Ignore output
+    if (Pid == 0) {
+      dup2(CtlPipe[0], kForkSrvCtlFd);
+      dup2(StatusPipe[1], kForkSrvStatusFd);
+
+      const auto DevNull = open("/dev/null", O_RDWR);
+      dup2(DevNull, STDOUT_FILENO);
+      dup2(DevNull, STDERR_FILENO);
+
+      execve(Argv[0], Argv.data(), Envp.data());
+      _exit(127);
+    }
+
+    close(CtlPipe[0]);
+    close(StatusPipe[1]);
+    std::unique_ptr<ForkServer> Srv(
+        new ForkServer(Pid, CtlPipe[1], StatusPipe[0]));
+
+    uint32_t Hello;
+    if (!readAll(Srv->StatusFd, &Hello, sizeof(Hello)) ||
+        Hello != kForkSrvHello) {
+      return createStringError(inconvertibleErrorCode(),
+                               "%s did not start a fork server (is it linked "
+                               "with a coverage runtime?)",
+                               Args.front().c_str());
+    }
+
+    return std::move(Srv);
+  }
+
+  /// Run the target once, writing coverage to the given path. Returns `false`
+  /// if the fork server has died
+  bool run(const StringRef &OutPath) {
+    const uint32_t Len = OutPath.size();
+    int32_t ChildPid, Status;
+    return writeAll(CtlFd, &Len, sizeof(Len)) &&
+           writeAll(CtlFd, OutPath.data(), Len) &&
+           readAll(StatusFd, &ChildPid, sizeof(ChildPid)) &&
+           readAll(StatusFd, &Status, sizeof(Status));
+  }
+
+private:
+  ForkServer(pid_t Pid, int CtlFd, int StatusFd)
+      : Pid(Pid), CtlFd(CtlFd), StatusFd(StatusFd) {}
+
+  const pid_t Pid;
+  const int CtlFd;
+  const int StatusFd;
+};
+
+/// Environment for targets running a fork server
+static std::vector<std::string> getForkServerEnv() {
+  std::vector<std::string> Env;
+  for (const auto *E = environ; *E; ++E) {
+    Env.emplace_back(*E);
+  }
+  Env.emplace_back("FUZZALLOC_FORKSERVER=1");
+  if (!getenv("LLVM_PROFILE_TIMEOUT")) {
+    Env.emplace_back("LLVM_PROFILE_TIMEOUT=10000");
+  }
+  if (!getenv("LLVM_PROFILE_FORMAT")) {
+    Env.emplace_back("LLVM_PROFILE_FORMAT=binary");
+  }
+  return Env;
+}
+
+/// Target command line, with the given input file replacing `@@` (or appended
+/// if there is no `@@`)
+static std::vector<std::string>
+getTargetCommand(const StringRef &Target,
+                 const ArrayRef<std::string> &TargetArgs,
+                 const StringRef &InputPath) {
+  std::vector<std::string> Args{Target.str()};
+  Args.insert(Args.end(), TargetArgs.begin(), TargetArgs.end());
+  const auto AtAtIt = std::find(Args.begin() + 1, Args.end(), "@@");
+  if (AtAtIt == Args.end()) {
+    Args.push_back(InputPath.str());
+  } else {
+    *AtAtIt = InputPath.str();
+  }
+  return Args;
+}
+
+/// Replay testcases through fork servers (one per thread). Each worker copies
+/// each testcase to a fixed input file (that replaces `@@`), then calls `Run`
+/// with the worker's fork server and the testcase index. `Run` returns `false`
+/// if the fork server died, in which case it is restarted
+static Error replayForkServer(const StringRef &Target,
+                              const ArrayRef<std::string> &TargetArgs,
+                              const ArrayRef<std::string> &Testcases,
+                              unsigned NumThreads,
+                              function_ref<bool(ForkServer &, size_t)> Run) {
+  //
+  // Initialize thread pool
+  //
+
+  if (NumThreads == 0) {
+    NumThreads = (Testcases.size() + 1) / 2;
+    NumThreads =
+        std::min(hardware_concurrency().compute_thread_count(), NumThreads);
+  }
+  NumThreads = std::max(NumThreads, 1U);
+  ThreadPool Pool(hardware_concurrency(NumThreads));
+
+  const auto Env = getForkServerEnv();
+
+  std::atomic<size_t> Next = 0;
+  std::mutex ErrLock;
+  Error Err = Error::success();
+
+  const auto Replay = [&]() {
+    SmallString<32> InputPath;
+    if (sys::fs::createTemporaryFile("replay", "input", InputPath)) {
+      return;
+    }
+
+    const auto Args = getTargetCommand(Target, TargetArgs, InputPath);
+    std::unique_ptr<ForkServer> Srv;
+    for (auto I = Next++; I < Testcases.size(); I = Next++) {
+      // (Re)start the fork server
+      if (!Srv) {
+        auto SrvOrErr = ForkServer::start(Args, Env);
+        if (auto E = SrvOrErr.takeError()) {
+          std::scoped_lock SL(ErrLock);
+          Err = joinErrors(std::move(Err), std::move(E));
+          break;
+        }
+        Srv = std::move(*SrvOrErr);
+      }
+
+      if (sys::fs::copy_file(Testcases[I], InputPath)) {
+        continue;
+      }
+      if (!Run(*Srv, I)) {
+        Srv.reset();
+      }
+    }
+
+    Srv.reset();
+    sys::fs::remove(InputPath);
+  };
+
+  for (unsigned I = 0; I < NumThreads; ++I) {
+    Pool.async(Replay);
+  }
+
+  Pool.wait();
+
+  return Err;
+}
+
+/// Replays single testcases through fork servers on demand, collecting
+/// coverage through shared memory. Fork servers are reused between replays,
+/// and a new one is only started when all existing ones are busy (so there are
+/// as many fork servers as threads replaying at once)
+class ShmReplayer {
+public:
+  ShmReplayer(const StringRef &Target, const ArrayRef<std::string> &TargetArgs)
+      : Target(Target.str()), TargetArgs(TargetArgs.vec()),
+        Env(getForkServerEnv()) {}
+
+  /// Replay a testcase, returning its coverage
+  Expected<std::unique_ptr<MemoryBuffer>> replay(const StringRef &Testcase) {
+    auto WOrErr = acquire();
+    if (auto E = WOrErr.takeError()) {
+      return std::move(E);
+    }
+    auto W = std::move(*WOrErr);
+
+    if (const auto EC = sys::fs::copy_file(Testcase, W->InputPath)) {
+      release(std::move(W));
+      return errorCodeToError(EC);
+    }
+    if (ftruncate(W->ShmFd, 0) != 0) {
+      release(std::move(W));
+      return errorCodeToError(std::error_code(errno, std::generic_category()));
+    }
+
+    // The coverage runtimes write to `LLVM_PROFILE_FILE`, which refers to the
+    // worker's shared memory region (inherited by the fork server's children)
+    if (!W->Srv->run("/proc/self/fd/" + std::to_string(W->ShmFd))) {
+      // Restart the fork server on the next replay
+      W->Srv.reset();
+      release(std::move(W));
+      return createStringError(inconvertibleErrorCode(),
+                               "fork server died while replaying %s",
+                               Testcase.str().c_str());
+    }
+
+    // Targets that crash may not produce any coverage
+    struct stat St;
+    if (fstat(W->ShmFd, &St) != 0 || St.st_size == 0) {
+      release(std::move(W));
+      return createStringError(inconvertibleErrorCode(),
+                               "%s produced no coverage",
+                               Testcase.str().c_str());
+    }
+
+    auto Buf =
+        WritableMemoryBuffer::getNewUninitMemBuffer(St.st_size, Testcase);
+    const bool Read =
+        Buf && pread(W->ShmFd, Buf->getBufferStart(), St.st_size, 0) ==
+                   St.st_size;
+    release(std::move(W));
+    if (!Read) {
+      return createStringError(inconvertibleErrorCode(),
+                               "failed to read coverage for %s",
+                               Testcase.str().c_str());
+    }
+    return std::unique_ptr<MemoryBuffer>(std::move(Buf));
+  }
+
+private:
+  /// A fork server, its input file, and its shared memory region
+  struct Worker {
+    Worker(const Worker &) = delete;
+    Worker() = default;
+
+    ~Worker() {
+      Srv.reset();
+      if (ShmFd >= 0) {
+        close(ShmFd);
+      }
+      if (!InputPath.empty()) {
+        sys::fs::remove(InputPath);
+      }
+    }
+
+    SmallString<32> InputPath;
+    int ShmFd = -1;
+    std::unique_ptr<ForkServer> Srv;
+  };
+
+  /// Get an idle worker (with a running fork server), creating one if there is
+  /// none
+  Expected<std::unique_ptr<Worker>> acquire() {
+    std::unique_ptr<Worker> W;
+    {
+      std::scoped_lock SL(Lock);
+      if (!Idle.empty()) {
+        W = std::move(Idle.back());
+        Idle.pop_back();
+      }
+    }
+
+    if (!W) {
+      W = std::make_unique<Worker>();
+      if (const auto EC =
+              sys::fs::createTemporaryFile("replay", "input", W->InputPath)) {
+        return errorCodeToError(EC);
+      }
+
+      // Must be created before the fork server, so that it is inherited
+      if ((W->ShmFd = memfd_create("coverage", 0)) < 0) {
+        return errorCodeToError(
+            std::error_code(errno, std::generic_category()));
+      }
+    }
+
+    // (Re)start the fork server
+    if (!W->Srv) {
+      auto SrvOrErr = ForkServer::start(
+          getTargetCommand(Target, TargetArgs, W->InputPath), Env);
+      if (auto E = SrvOrErr.takeError()) {
+        return std::move(E);
+      }
+      W->Srv = std::move(*SrvOrErr);
+    }
+
+    return std::move(W);
+  }
+
+  void release(std::unique_ptr<Worker> W) {
+    std::scoped_lock SL(Lock);
+    Idle.push_back(std::move(W));
+  }
+
+  const std::string Target;
+  const std::vector<std::string> TargetArgs;
+  const std::vector<std::string> Env;
+
+  std::mutex Lock;
+  std::vector<std::unique_ptr<Worker>> Idle;
+};
 } // anonymous namespace
 
 Expected<size_t> getNumFiles(const StringRef &P) {
@@ -117,6 +555,13 @@ Error genCoverage(
       Env.push_back(Timeout);
     }
 
+    // Traces are only ever read back by the def-use tools, so request the
+    // compact binary format (ignored by the LLVMCovRuntime)
+    if (!getenv("LLVM_PROFILE_FORMAT")) {
+      const auto Format = "LLVM_PROFILE_FORMAT=binary";
+      Env.push_back(Format);
+    }
+
     // Run target. Ignore output and return code
     sys::ExecuteAndWait(ProfInstArgs[0], ProfInstArgs, ArrayRef(Env),
                         Redirects);
@@ -136,6 +581,523 @@ Error genCoverage(
   return Error::success();
 }
 
+Error genCoveragePersistent(
+    const StringRef &Target, ///< Path to instrumented target
+    const StringRef &InDir,  ///< Directory containing target inputs
+    const StringRef &OutDir, ///< Directory storing coverage results
+    unsigned NumThreads      ///< Number of simultaneous threads
+) {
+  auto TestcasesOrErr = getTestcases(InDir);
+  if (auto E = TestcasesOrErr.takeError()) {
+    return E;
+  }
+  const std::vector<std::string> Testcases(TestcasesOrErr->begin(),
+                                           TestcasesOrErr->end());
+
+  //
+  // Initialize thread pool
+  //
+
+  if (NumThreads == 0) {
+    NumThreads = std::min(hardware_concurrency().compute_thread_count(),
+                          static_cast<unsigned>(Testcases.size()));
+  }
+  NumThreads = std::max(NumThreads, 1U);
+  ThreadPool Pool(hardware_concurrency(NumThreads));
+
+  // Configure environment
+  auto Env = toStringRefArray(environ);
+
+  const auto ProfDirEnv = "LLVM_PROFILE_DIR=" + OutDir.str();
+  Env.push_back(ProfDirEnv.c_str());
+  if (!getenv("LLVM_PROFILE_TIMEOUT")) {
+    const auto Timeout = "LLVM_PROFILE_TIMEOUT=10000";
+    Env.push_back(Timeout);
+  }
+  if (!getenv("LLVM_PROFILE_FORMAT")) {
+    const auto Format = "LLVM_PROFILE_FORMAT=binary";
+    Env.push_back(Format);
+  }
+
+  const auto hasTrace = [&](const StringRef &Testcase) {
+    SmallString<32> Trace;
+    sys::path::append(Trace, OutDir, sys::path::filename(Testcase));
+    return sys::fs::exists(Trace);
+  };
+
+  //
+  // Generate raw coverage files. Each batch is replayed in a single process.
+  // If the target crashes or times out, the rest of the batch is replayed in a
+  // new process
+  //
+
+  const auto Replay = [&](ArrayRef<std::string> Batch) {
+    while (!Batch.empty()) {
+      SmallString<32> ListPath;
+      if (sys::fs::createTemporaryFile("replay", "txt", ListPath)) {
+        return;
+      }
+
+      {
+        std::error_code EC;
+        raw_fd_ostream OS(ListPath, EC, sys::fs::OF_Text);
+        if (EC) {
+          return;
+        }
+        for (const auto &Testcase : Batch) {
+          OS << Testcase << '\n';
+        }
+      }
+
+      // Run target. Ignore output and return code
+      const Optional<StringRef> Redirects[3] = {StringRef(ListPath),
+                                                StringRef(), StringRef()};
+      sys::ExecuteAndWait(Target, {Target}, ArrayRef(Env), Redirects);
+      sys::fs::remove(ListPath);
+
+      // Resume after the last testcase with a trace. If the first testcase
+      // has no trace, then it crashed the target, so skip it
+      const auto *It =
+          find_if(Batch, [&](const auto &T) { return !hasTrace(T); });
+      if (It == Batch.begin()) {
+        ++It;
+      }
+      Batch = Batch.drop_front(std::distance(Batch.begin(), It));
+    }
+  };
+
+  const auto BatchSize = (Testcases.size() + NumThreads - 1) / NumThreads;
+  for (size_t I = 0; I < Testcases.size(); I += BatchSize) {
+    Pool.async(Replay, ArrayRef(Testcases).slice(
+                           I, std::min(BatchSize, Testcases.size() - I)));
+  }
+
+  Pool.wait();
+
+  return Error::success();
+}
+
+Error genCoverageForkServer(
+    const StringRef &Target,                 ///< Path to instrumented target
+    const ArrayRef<std::string> &TargetArgs, ///< Target program arguments
+    const StringRef &InDir,  ///< Directory containing target inputs
+    const StringRef &OutDir, ///< Directory storing coverage results
+    unsigned NumThreads      ///< Number of simultaneous threads
+) {
+  auto TestcasesOrErr = getTestcases(InDir);
+  if (auto E = TestcasesOrErr.takeError()) {
+    return E;
+  }
+  const std::vector<std::string> Testcases(TestcasesOrErr->begin(),
+                                           TestcasesOrErr->end());
+
+  return replayForkServer(
+      Target, TargetArgs, Testcases, NumThreads,
+      [&](ForkServer &Srv, size_t Idx) {
+        SmallString<32> OutPath;
+        sys::path::append(OutPath, OutDir,
+                          sys::path::filename(Testcases[Idx]));
+        return Srv.run(OutPath);
+      });
+}
+
+Expected<RawCoverages> genCoverageShm(
+    const StringRef &Target,                 ///< Path to instrumented target
+    const ArrayRef<std::string> &TargetArgs, ///< Target program arguments
+    const StringRef &InDir ///< Directory containing target inputs
+) {
+  auto TestcasesOrErr = getTestcases(InDir);
+  if (auto E = TestcasesOrErr.takeError()) {
+    return std::move(E);
+  }
+
+  // Testcases are replayed when their coverage is loaded, so each buffer can be
+  // released once it is parsed (rather than holding the whole queue's coverage
+  // in memory)
+  auto Replayer = std::make_shared<ShmReplayer>(Target, TargetArgs);
+
+  RawCoverages Covs;
+  Covs.reserve(TestcasesOrErr->size());
+  for (const auto &Testcase : *TestcasesOrErr) {
+    Covs.push_back({Testcase, nullptr, [Replayer, Testcase]() {
+                      return Replayer->replay(Testcase);
+                    }});
+  }
+  return std::move(Covs);
+}
+
+Expected<RawCoverages> getRawCoverages(const StringRef &CovDir) {
+  auto CovFilesOrErr = getTestcases(CovDir);
+  if (auto E = CovFilesOrErr.takeError()) {
+    return std::move(E);
+  }
+
+  RawCoverages Covs;
+  Covs.reserve(CovFilesOrErr->size());
+  for (const auto &CovFile : *CovFilesOrErr) {
+    Covs.push_back({CovFile, nullptr});
+  }
+  return std::move(Covs);
+}
+
+Expected<MemoryBufferRef> RawCoverage::load() {
+  if (!Buf && Gen) {
+    auto BufOrErr = Gen();
+    if (auto E = BufOrErr.takeError()) {
+      return std::move(E);
+    }
+    Buf = std::move(*BufOrErr);
+  } else if (!Buf) {
+    auto BufOrErr = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                          /*RequiresNullTerminator=*/false);
+    if (const auto &EC = BufOrErr.getError()) {
+      return errorCodeToError(EC);
+    }
+    Buf = std::move(*BufOrErr);
+  }
+  return Buf->getMemBufferRef();
+}
+
+Expected<size_t> genCoverageCached(
+    const StringRef &CacheDir,               ///< Coverage cache directory
+    const StringRef &Target,                 ///< Path to instrumented target
+    const ArrayRef<std::string> &TargetArgs, ///< Target program arguments
+    const StringRef &InDir,  ///< Directory containing target inputs
+    const StringRef &OutDir, ///< Directory storing coverage results
+    function_ref<Error(const StringRef &)> Gen ///< Replays a directory
+) {
+  //
+  // Coverage depends on the target, its arguments, and the runtime options, so
+  // these form the cache key
+  //
+
+  MD5 TargetHash;
+  for (const auto &Arg : TargetArgs) {
+    TargetHash.update(Arg);
+    TargetHash.update(StringRef("\0", 1));
+  }
+  for (const auto *E = environ; *E; ++E) {
+    if (StringRef(*E).startswith("LLVM_PROFILE_")) {
+      TargetHash.update(*E);
+      TargetHash.update(StringRef("\0", 1));
+    }
+  }
+  auto TargetKeyOrErr = hashFile(Target, TargetHash);
+  if (auto E = TargetKeyOrErr.takeError()) {
+    return std::move(E);
+  }
+
+  SmallString<32> TargetCache(CacheDir);
+  sys::path::append(TargetCache, *TargetKeyOrErr);
+  if (const auto EC = sys::fs::create_directories(TargetCache)) {
+    return errorCodeToError(EC);
+  }
+
+  auto TestcasesOrErr = getTestcases(InDir);
+  if (auto E = TestcasesOrErr.takeError()) {
+    return std::move(E);
+  }
+
+  // Testcases that miss the cache are replayed from a directory of links to
+  // them (preserving their names)
+  SmallString<32> MissDir;
+  if (const auto EC = sys::fs::createUniqueDirectory("replay", MissDir)) {
+    return errorCodeToError(EC);
+  }
+
+  //
+  // Restore cached coverage
+  //
+
+  std::vector<std::pair<std::string, std::string>> Misses;
+  size_t NumHits = 0;
+
+  for (const auto &Testcase : *TestcasesOrErr) {
+    MD5 Hash;
+    auto KeyOrErr = hashFile(Testcase, Hash);
+    if (auto E = KeyOrErr.takeError()) {
+      return std::move(E);
+    }
+
+    const auto Name = sys::path::filename(Testcase);
+
+    SmallString<32> Cached(TargetCache);
+    sys::path::append(Cached, *KeyOrErr);
+    SmallString<32> Out(OutDir);
+    sys::path::append(Out, Name);
+
+    if (sys::fs::exists(Cached) && !sys::fs::copy_file(Cached, Out)) {
+      NumHits++;
+      continue;
+    }
+
+    SmallString<128> AbsTestcase(Testcase);
+    sys::fs::make_absolute(AbsTestcase);
+    SmallString<32> Link(MissDir);
+    sys::path::append(Link, Name);
+    if (const auto EC = sys::fs::create_link(AbsTestcase, Link)) {
+      return errorCodeToError(EC);
+    }
+    Misses.emplace_back(Name.str(), std::move(*KeyOrErr));
+  }
+
+  //
+  // Replay (and cache) the remaining testcases. Testcases that produce no
+  // coverage (e.g., because they crashed the target) are not cached
+  //
+
+  if (!Misses.empty()) {
+    if (auto E = Gen(MissDir)) {
+      sys::fs::remove_directories(MissDir);
+      return std::move(E);
+    }
+
+    for (const auto &[Name, Key] : Misses) {
+      SmallString<32> Out(OutDir);
+      sys::path::append(Out, Name);
+      if (!sys::fs::exists(Out)) {
+        continue;
+      }
+
+      // Write atomically, so concurrent runs never see a partial entry
+      SmallString<32> Cached(TargetCache);
+      sys::path::append(Cached, Key);
+      SmallString<32> Tmp;
+      if (sys::fs::createUniqueFile(Cached + ".%%%%%%", Tmp)) {
+        continue;
+      }
+      if (sys::fs::copy_file(Out, Tmp) || sys::fs::rename(Tmp, Cached)) {
+        sys::fs::remove(Tmp);
+      }
+    }
+  }
+
+  sys::fs::remove_directories(MissDir);
+
+  return NumHits;
+}
+
+Expected<RawCoverages> replayQueue(
+    const ReplayOptions &Opts, ///< Replay options
+    const StringRef &QueueDir, ///< Directory containing target inputs
+    SmallVectorImpl<char> &CovDir ///< Directory storing coverage results
+) {
+  const auto &Target = Opts.Target;
+  const auto &TargetArgs = Opts.TargetArgs;
+  const auto NumThreads = Opts.NumThreads;
+
+  if (Opts.Persistent && (Opts.ForkServer || Opts.Shm)) {
+    return createStringError(
+        inconvertibleErrorCode(),
+        "persistent mode cannot be used with the fork server");
+  }
+  if (Opts.Shm && !Opts.CacheDir.empty()) {
+    return createStringError(inconvertibleErrorCode(),
+                             "shared memory cannot be used with a cache");
+  }
+  if (Opts.Persistent && !TargetArgs.empty()) {
+    warning_stream() << "Target arguments are ignored in persistent mode\n";
+  }
+
+  auto NumTestcasesOrErr = getNumFiles(QueueDir);
+  if (auto E = NumTestcasesOrErr.takeError()) {
+    return std::move(E);
+  }
+  status_stream() << "Generating raw profiles for " << *NumTestcasesOrErr
+                  << " testcases (in `" << QueueDir << "`) using target `"
+                  << Target << "`...\n";
+
+  if (Opts.Shm) {
+    return genCoverageShm(Target, TargetArgs, QueueDir);
+  }
+
+  if (const auto EC = sys::fs::createUniqueDirectory("coverage", CovDir)) {
+    return errorCodeToError(EC);
+  }
+  const StringRef OutDir(CovDir.data(), CovDir.size());
+
+  const auto Gen = [&](const StringRef &InDir) -> Error {
+    if (Opts.Persistent) {
+      return genCoveragePersistent(Target, InDir, OutDir, NumThreads);
+    } else if (Opts.ForkServer) {
+      return genCoverageForkServer(Target, TargetArgs, InDir, OutDir,
+                                   NumThreads);
+    }
+    return genCoverage(Target, TargetArgs, InDir, OutDir, NumThreads);
+  };
+
+  if (Opts.CacheDir.empty()) {
+    if (auto E = Gen(QueueDir)) {
+      return std::move(E);
+    }
+  } else {
+    auto NumCachedOrErr = genCoverageCached(Opts.CacheDir, Target, TargetArgs,
+                                            QueueDir, OutDir, Gen);
+    if (auto E = NumCachedOrErr.takeError()) {
+      return std::move(E);
+    }
+    status_stream() << *NumCachedOrErr << " raw profiles restored from `"
+                    << Opts.CacheDir << "`\n";
+  }
+
+  return getRawCoverages(OutDir);
+}
+
+Expected<RawCoverages> replayTrials(
+    const ReplayOptions &Opts,              ///< Replay options
+    const ArrayRef<std::string> &QueueDirs, ///< Queue directories
+    std::vector<Trial> &Trials,             ///< Deduplicated trials
+    SmallVectorImpl<char> &CovDir ///< Directory storing coverage results
+) {
+  SmallString<32> UniqueDir;
+  if (const auto EC = sys::fs::createUniqueDirectory("batch", UniqueDir)) {
+    return errorCodeToError(EC);
+  }
+
+  auto TrialsOrErr = dedupQueues(QueueDirs, UniqueDir);
+  if (auto E = TrialsOrErr.takeError()) {
+    sys::fs::remove_directories(UniqueDir);
+    return std::move(E);
+  }
+  Trials = std::move(*TrialsOrErr);
+
+  size_t NumTestcases = 0;
+  for (const auto &T : Trials) {
+    NumTestcases += T.Testcases.size();
+  }
+  status_stream() << "Replaying " << NumTestcases << " testcases from "
+                  << Trials.size() << " trials\n";
+
+  auto CovsOrErr = replayQueue(Opts, UniqueDir, CovDir);
+  if (CovsOrErr && Opts.Shm) {
+    // Testcases are only replayed when their coverage is loaded, so keep them
+    // until the caller removes the coverage directory
+    CovDir.assign(UniqueDir.begin(), UniqueDir.end());
+  } else {
+    sys::fs::remove_directories(UniqueDir);
+  }
+  return CovsOrErr;
+}
+
+std::string getTrialOutput(const StringRef &OutDir,
+                           const StringRef &QueueDir) {
+  // Queues are typically `<trial>/queue`, so name the output after the whole
+  // (relative) queue path
+  auto Name = sys::path::relative_path(
+                  sys::path::remove_leading_dotslash(QueueDir.rtrim('/')))
+                  .str();
+  std::replace(Name.begin(), Name.end(), '/', '_');
+
+  SmallString<128> Out(OutDir);
+  sys::path::append(Out, Name + ".json");
+  return Out.str().str();
+}
+
+Expected<TimeBins> binCoverages(
+    const RawCoverages &Covs,  ///< Raw coverage (in testcase order)
+    const StringRef &QueueDir, ///< Directory containing target inputs
+    TimestampSource Source,    ///< Where timestamps are read from
+    const StringRef &CSVPath,  ///< Timestamp CSV (if reading from a CSV)
+    uint64_t BinSize           ///< Time bucket size (in seconds)
+) {
+  if (BinSize == 0) {
+    return createStringError(inconvertibleErrorCode(),
+                             "time bucket size must be non-zero");
+  }
+
+  // Testcase timestamps from a CSV (in seconds)
+  StringMap<double> CSVTimes;
+  if (Source == TimestampSource::CSV) {
+    auto BufOrErr = MemoryBuffer::getFile(CSVPath, /*IsText=*/true);
+    if (const auto EC = BufOrErr.getError()) {
+      return errorCodeToError(EC);
+    }
+
+    SmallVector<StringRef, 0> Lines;
+    (*BufOrErr)->getBuffer().split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    for (const auto &Line : Lines) {
+      const auto [Name, TimeStr] = Line.rtrim('\r').rsplit(',');
+      double Time;
+      if (TimeStr.trim().getAsDouble(Time)) {
+        return createStringError(inconvertibleErrorCode(),
+                                 "invalid CSV row `%s`", Line.str().c_str());
+      }
+      CSVTimes[sys::path::filename(Name.trim())] = Time;
+    }
+  }
+
+  // Testcase timestamps (in milliseconds). Absolute timestamps are made
+  // relative to the earliest testcase
+  std::vector<Optional<double>> Times(Covs.size());
+  for (size_t Idx = 0; Idx < Covs.size(); ++Idx) {
+    const auto Name = sys::path::filename(Covs[Idx].Path);
+
+    switch (Source) {
+    case TimestampSource::None:
+      Times[Idx] = 0;
+      break;
+    case TimestampSource::AFL: {
+      SmallVector<StringRef, 8> Fields;
+      Name.split(Fields, ',');
+      for (auto Field : Fields) {
+        uint64_t Time;
+        if (Field.consume_front("time:") && to_integer(Field, Time, 10)) {
+          Times[Idx] = Time;
+        }
+      }
+      break;
+    }
+    case TimestampSource::MTime: {
+      SmallString<128> Path(QueueDir);
+      sys::path::append(Path, Name);
+      sys::fs::file_status Status;
+      if (!sys::fs::status(Path, Status)) {
+        Times[Idx] = std::chrono::duration<double, std::milli>(
+                         Status.getLastModificationTime().time_since_epoch())
+                         .count();
+      }
+      break;
+    }
+    case TimestampSource::CSV: {
+      const auto It = CSVTimes.find(Name);
+      if (It != CSVTimes.end()) {
+        Times[Idx] = It->second * 1000;
+      }
+      break;
+    }
+    }
+
+    if (!Times[Idx]) {
+      warning_stream() << "No timestamp for `" << Name << "`. Skipping...\n";
+    }
+  }
+
+  double Start = 0;
+  if (Source == TimestampSource::MTime || Source == TimestampSource::CSV) {
+    Start = std::numeric_limits<double>::max();
+    for (const auto &Time : Times) {
+      if (Time) {
+        Start = std::min(Start, *Time);
+      }
+    }
+  }
+
+  TimeBins Bins;
+  for (size_t Idx = 0; Idx < Covs.size(); ++Idx) {
+    if (!Times[Idx]) {
+      continue;
+    }
+    const auto Bin =
+        static_cast<size_t>((*Times[Idx] - Start) / 1000 / BinSize);
+    if (Bin >= Bins.size()) {
+      Bins.resize(Bin + 1);
+    }
+    Bins[Bin].push_back(Idx);
+  }
+
+  return Bins;
+}
+
 json::Value toJSON(const TestcaseCoverage &Cov) {
   return {Cov.Path, clamp_uint64_to_int64(Cov.Count)};
 }
@@ -153,3 +1115,21 @@ llvm::Error writeJSON(const llvm::StringRef &Out,
 
   return llvm::Error::success();
 }
+
+json::Value toJSON(const TimeBinCoverage &Cov) {
+  return {clamp_uint64_to_int64(Cov.Time), clamp_uint64_to_int64(Cov.Count)};
+}
+
+llvm::Error writeJSON(const llvm::StringRef &Out,
+                      const TimeBinCoverages &Cov) {
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Out, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    return llvm::errorCodeToError(EC);
+  }
+
+  OS << json::Value(Cov);
+  OS.close();
+
+  return llvm::Error::success();
+}
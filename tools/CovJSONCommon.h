@@ -10,9 +10,13 @@
 
 #include <stdint.h>
 
+#include <functional>
+#include <memory>
 #include <vector>
 
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include "absl/container/btree_set.h"
@@ -32,6 +36,63 @@ struct TestcaseCoverage {
 
 using TestcaseCoverages = std::vector<TestcaseCoverage>;
 
+struct TimeBinCoverage {
+  const uint64_t Time;  ///< End of the time bucket (in seconds)
+  const uint64_t Count; ///< Number of coverage elements hit
+
+  TimeBinCoverage() = delete;
+  TimeBinCoverage(uint64_t T, uint64_t C) : Time(T), Count(C) {}
+};
+
+using TimeBinCoverages = std::vector<TimeBinCoverage>;
+
+/// Where testcase timestamps are read from
+enum class TimestampSource {
+  None,  ///< No timestamps (testcases are ordered by name)
+  AFL,   ///< AFL++ `time:` field (in the testcase name)
+  MTime, ///< Testcase modification time
+  CSV,   ///< CSV file of (testcase name, timestamp) rows
+};
+
+/// A queue (from one of several trials), with each testcase mapped to a
+/// deduplicated copy of it
+struct Trial {
+  std::string QueueDir;               ///< Queue directory
+  std::vector<std::string> Testcases; ///< Testcase names (in testcase order)
+  std::vector<std::string> Hashes;    ///< Testcase content hashes
+};
+
+/// Raw coverage indices in each (fixed-size) time bucket
+using TimeBins = std::vector<std::vector<size_t>>;
+
+/// Raw coverage (a trace or profile) for a single testcase. The coverage is
+/// either in a file or is collected in memory (by replaying the testcase) when
+/// first loaded
+struct RawCoverage {
+  using Generator =
+      std::function<llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>()>;
+
+  std::string Path;                        ///< Coverage (or testcase) path
+  std::unique_ptr<llvm::MemoryBuffer> Buf; ///< Coverage data (if loaded)
+  Generator Gen; ///< Collects the coverage data (if not in a file)
+
+  /// Get the coverage data, reading (or collecting) it if necessary
+  llvm::Expected<llvm::MemoryBufferRef> load();
+};
+
+using RawCoverages = std::vector<RawCoverage>;
+
+/// How to replay testcases through the target
+struct ReplayOptions {
+  std::string Target;                  ///< Path to instrumented target
+  std::vector<std::string> TargetArgs; ///< Target program arguments
+  unsigned NumThreads = 0;             ///< Number of simultaneous threads
+  bool Persistent = false; ///< Target is linked with the tracer replay main
+  bool ForkServer = false; ///< Replay through the runtime's fork server
+  bool Shm = false;        ///< Collect coverage through shared memory
+  std::string CacheDir;    ///< Coverage cache directory (optional)
+};
+
 //
 // Helper functions
 //
@@ -48,7 +109,69 @@ llvm::Error genCoverage(const llvm::StringRef &,
                         const llvm::StringRef &, const llvm::StringRef &,
                         unsigned = 0);
 
+/// Replay testcases through a target linked with the persistent-mode tracer
+/// replay main, batching testcases into one process per thread
+llvm::Error genCoveragePersistent(const llvm::StringRef &,
+                                  const llvm::StringRef &,
+                                  const llvm::StringRef &, unsigned = 0);
+
+/// Replay testcases through a target's fork server (provided by the tracer and
+/// LLVMCov runtimes), forking each run from a warmed-up process rather than
+/// executing the target from scratch
+llvm::Error genCoverageForkServer(const llvm::StringRef &,
+                                  const llvm::ArrayRef<std::string> &,
+                                  const llvm::StringRef &,
+                                  const llvm::StringRef &, unsigned = 0);
+
+/// Replay testcases through a target's fork server, collecting coverage through
+/// shared memory (rather than writing it to disk). Returns coverage in testcase
+/// order. Each testcase is only replayed when its coverage is loaded, so
+/// coverage can be consumed (and released) as soon as it is collected. Loading
+/// coverage from several threads replays through several fork servers
+llvm::Expected<RawCoverages>
+genCoverageShm(const llvm::StringRef &, const llvm::ArrayRef<std::string> &,
+               const llvm::StringRef &);
+
+/// Get the raw coverage files in the given directory (in testcase order)
+llvm::Expected<RawCoverages> getRawCoverages(const llvm::StringRef &);
+
+/// Generate coverage through a persistent cache keyed by (target, testcase
+/// content). Cached coverage is copied to the output directory, and only the
+/// remaining testcases are replayed (using the given generator). Returns the
+/// number of cached testcases
+llvm::Expected<size_t> genCoverageCached(
+    const llvm::StringRef &, const llvm::StringRef &,
+    const llvm::ArrayRef<std::string> &, const llvm::StringRef &,
+    const llvm::StringRef &,
+    llvm::function_ref<llvm::Error(const llvm::StringRef &)>);
+
+/// Replay a queue through the target, returning raw coverage (in testcase
+/// order). Coverage files (if any) are written to a new directory, which is
+/// returned so that the caller can remove it
+llvm::Expected<RawCoverages> replayQueue(const ReplayOptions &,
+                                         const llvm::StringRef &,
+                                         llvm::SmallVectorImpl<char> &);
+
+/// Replay several queues (trials) through the target, deduplicating testcases
+/// across queues by content so that each unique testcase is only replayed once.
+/// Raw coverage is named by testcase content hash (see `Trial::Hashes`)
+llvm::Expected<RawCoverages> replayTrials(const ReplayOptions &,
+                                          const llvm::ArrayRef<std::string> &,
+                                          std::vector<Trial> &,
+                                          llvm::SmallVectorImpl<char> &);
+
+/// Get a trial's output path (in the given output directory) in batch mode
+std::string getTrialOutput(const llvm::StringRef &, const llvm::StringRef &);
+
+/// Bin raw coverage into fixed-size time buckets (in seconds), based on each
+/// testcase's timestamp. Timestamps are relative to the earliest testcase
+/// (AFL++ `time:` fields are already relative to the start of the campaign)
+llvm::Expected<TimeBins> binCoverages(const RawCoverages &,
+                                      const llvm::StringRef &, TimestampSource,
+                                      const llvm::StringRef &, uint64_t);
+
 /// Write final JSON file
 llvm::Error writeJSON(const llvm::StringRef &, const TestcaseCoverages &);
+llvm::Error writeJSON(const llvm::StringRef &, const TimeBinCoverages &);
 
 #endif // COV_JSON_COMMON_H
@@ -0,0 +1,166 @@
+//===-- DUACommon.cpp - Common code for def-use coverage --------*- C++ -*-===//
+///
+/// \file
+/// Common code for def-use coverage tools.
+///
+//===----------------------------------------------------------------------===//
+
+#include <deque>
+#include <future>
+
+#include <llvm/ADT/Optional.h>
+#include <llvm/Support/NativeFormatting.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "fuzzalloc/Streams.h"
+
+#include "DUACommon.h"
+
+using namespace llvm;
+
+json::Value Interner::toJSON(const Location &Loc) const {
+  if (Loc.PC) {
+    return {string(Loc.File), string(Loc.Func), Loc.Line, Loc.Column, Loc.PC};
+  }
+  return {string(Loc.File), string(Loc.Func), Loc.Line, Loc.Column};
+}
+
+json::Value Interner::toJSON(uint64_t DefUse) const {
+  const auto &Def = definition(DefUse >> 32);
+  const auto &Use = location(DefUse & 0xffffffff);
+  return {json::Array{string(Def.Var), toJSON(location(Def.Loc))},
+          toJSON(Use)};
+}
+
+std::vector<uint64_t> Interner::merge(TraceDefUses &&Trace) {
+  const auto &Local = Trace.IDs;
+
+  // Map the trace's string, location, and def IDs to this interner's IDs
+  std::vector<uint32_t> StringIDs, LocIDs, DefIDs;
+  StringIDs.reserve(Local.StringTable.size());
+  LocIDs.reserve(Local.LocationTable.size());
+  DefIDs.reserve(Local.DefTable.size());
+
+  for (const auto &S : Local.StringTable) {
+    StringIDs.push_back(getString(S));
+  }
+  for (const auto &Loc : Local.LocationTable) {
+    LocIDs.push_back(intern(Location{StringIDs[Loc.File], StringIDs[Loc.Func],
+                                     Loc.Line, Loc.Column, Loc.PC}));
+  }
+  for (const auto &Def : Local.DefTable) {
+    DefIDs.push_back(intern(Definition{LocIDs[Def.Loc], StringIDs[Def.Var]}));
+  }
+
+  auto DefUses = std::move(Trace.DefUses);
+  for (auto &DefUse : DefUses) {
+    DefUse = getDefUse(DefIDs[DefUse >> 32], LocIDs[DefUse & 0xffffffff]);
+  }
+  return DefUses;
+}
+
+Expected<TraceDefUses> parseDefUses(RawCoverage &Cov, bool KeepPC) {
+  auto BufOrErr = Cov.load();
+  if (auto E = BufOrErr.takeError()) {
+    return std::move(E);
+  }
+
+  // Parse uses (ignore the count). Interning into the trace's own interner
+  // means that traces can be parsed in parallel without any locking
+  TraceDefUses Trace{Interner(KeepPC), {}};
+  auto &IDs = Trace.IDs;
+  auto E = DUATrace::visit(BufOrErr->getBuffer(), [&](const TraceDef &TDef) {
+    const auto Def = IDs.getDefinition(TDef);
+    for (const auto &TUse : TDef.Uses) {
+      Trace.DefUses.push_back(
+          Interner::getDefUse(Def, IDs.getLocation(TUse.Loc)));
+    }
+    return Error::success();
+  });
+  Cov.Buf.reset();
+  if (E) {
+    return std::move(E);
+  }
+
+  return std::move(Trace);
+}
+
+Expected<TestcaseCoverages> accumulateDefUseCoverage(
+    RawCoverages &Covs, ///< Raw coverage (in testcase order)
+    unsigned NumThreads ///< Number of parser threads
+) {
+  const auto NumCovFiles = Covs.size();
+
+  TestcaseCoverages TestcaseCovs;
+  TestcaseCovs.reserve(NumCovFiles);
+
+  Interner IDs;
+  DefUseSet AccumDefUses;
+  auto Count = 0;
+
+  //
+  // Parse tracer coverage. Traces are parsed in parallel, but merged in
+  // testcase order (so that coverage accumulates over time). At most `Window`
+  // parsed traces are buffered waiting to be merged
+  //
+
+  ThreadPool Pool(hardware_concurrency(NumThreads));
+  const size_t Window = 2 * Pool.getThreadCount();
+  std::vector<Optional<Expected<TraceDefUses>>> Parsed(Window);
+  std::deque<std::shared_future<void>> Pending;
+  size_t Next = 0;
+
+  const auto Submit = [&]() {
+    const auto Idx = Next++;
+    Pending.push_back(Pool.async(
+        [&, Idx]() { Parsed[Idx % Window] = parseDefUses(Covs[Idx]); }));
+  };
+
+  while (Next < std::min(Window, NumCovFiles)) {
+    Submit();
+  }
+
+  for (size_t Idx = 0; Idx < NumCovFiles; ++Idx) {
+    const auto &CovFile = Covs[Idx].Path;
+
+    Pending.front().wait();
+    Pending.pop_front();
+    auto TraceOrErr = std::move(*Parsed[Idx % Window]);
+    Parsed[Idx % Window].reset();
+
+    // The slot is free, so parse the next trace
+    if (Next < NumCovFiles) {
+      Submit();
+    }
+
+    if (auto E = TraceOrErr.takeError()) {
+      warning_stream() << '`' << CovFile << "`: " << E << ". Skipping...\n";
+      continue;
+    }
+
+    //
+    // Calculate coverage
+    //
+
+    for (const auto DefUse : IDs.merge(std::move(*TraceOrErr))) {
+      if (AccumDefUses.insert(DefUse).second) {
+        Count++;
+      }
+    }
+
+    TestcaseCovs.emplace_back(sys::path::filename(CovFile).str(), Count);
+
+    if (Idx % ((NumCovFiles + (10 - 1)) / 10) == 0) {
+      status_stream() << "  ";
+      write_double(outs(), static_cast<float>(Idx) / NumCovFiles,
+                   FloatStyle::Percent);
+      outs() << " raw profiles parsed (count = " << Count << ")\r";
+    }
+  }
+  outs() << '\n';
+
+  return TestcaseCovs;
+}
@@ -0,0 +1,169 @@
+//===-- DUACommon.h - Common code for def-use coverage ----------*- C++ -*-===//
+///
+/// \file
+/// Common code for def-use coverage tools.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef DUA_COMMON_H
+#define DUA_COMMON_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/JSON.h>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+
+#include "fuzzalloc/Runtime/Trace.h"
+
+#include "CovJSONCommon.h"
+
+//
+// Classes
+//
+
+/// Interned source location. Strings are interned IDs
+struct Location {
+  uint32_t File;
+  uint32_t Func;
+  uint32_t Line;
+  uint32_t Column;
+  uint64_t PC; ///< Zero for defs
+
+  bool operator==(const Location &Other) const {
+    return File == Other.File && Func == Other.Func && Line == Other.Line &&
+           Column == Other.Column && PC == Other.PC;
+  }
+
+  template <typename H> friend H AbslHashValue(H Hash, const Location &Loc) {
+    return H::combine(std::move(Hash), Loc.File, Loc.Func, Loc.Line, Loc.Column,
+                      Loc.PC);
+  }
+};
+
+/// Interned variable def. Locations and strings are interned IDs
+struct Definition {
+  uint32_t Loc;
+  uint32_t Var;
+
+  bool operator==(const Definition &Other) const {
+    return Loc == Other.Loc && Var == Other.Var;
+  }
+
+  template <typename H> friend H AbslHashValue(H Hash, const Definition &Def) {
+    return H::combine(std::move(Hash), Def.Loc, Def.Var);
+  }
+};
+
+struct TraceDefUses;
+
+/// Interns strings, locations, and defs, so that a def-use pair is identified
+/// by a single 64-bit ID (the def ID in the upper half and the use location ID
+/// in the lower half). Not thread-safe: traces are parsed into their own
+/// interner, and then merged into a shared one
+class Interner {
+public:
+  /// If `KeepPC` is false, uses are identified by source location only (i.e.,
+  /// uses that only differ in their program counter are merged)
+  explicit Interner(bool KeepPC = true) : KeepPC(KeepPC) {}
+
+  bool keepsPC() const { return KeepPC; }
+
+  uint32_t getString(const llvm::StringRef &S) {
+    const auto Res = Strings.try_emplace(S, Strings.size());
+    if (Res.second) {
+      StringTable.push_back(Res.first->first());
+    }
+    return Res.first->second;
+  }
+
+  uint32_t getLocation(const TraceLocation &TLoc) {
+    return intern(Location{getString(TLoc.File), getString(TLoc.Func),
+                           static_cast<uint32_t>(TLoc.Line),
+                           static_cast<uint32_t>(TLoc.Column),
+                           KeepPC ? TLoc.PC.getValueOr(0) : 0});
+  }
+
+  uint32_t getDefinition(const TraceDef &TDef) {
+    return intern(Definition{getLocation(TDef.Loc), getString(TDef.Var)});
+  }
+
+  /// Re-intern a trace's def-use pairs into this interner, returning their IDs
+  /// (in this interner)
+  std::vector<uint64_t> merge(TraceDefUses &&);
+
+  static uint64_t getDefUse(uint32_t Def, uint32_t Use) {
+    return (static_cast<uint64_t>(Def) << 32) | Use;
+  }
+
+  llvm::StringRef string(uint32_t ID) const { return StringTable[ID]; }
+  const Location &location(uint32_t ID) const { return LocationTable[ID]; }
+  const Definition &definition(uint32_t ID) const { return DefTable[ID]; }
+
+  /// Convert a def-use pair ID back to source-level JSON (in the same format
+  /// as the def-use trace JSON)
+  llvm::json::Value toJSON(uint64_t DefUse) const;
+
+private:
+  uint32_t intern(const Location &Loc) {
+    const auto Res = Locations.try_emplace(Loc, Locations.size());
+    if (Res.second) {
+      LocationTable.push_back(Loc);
+    }
+    return Res.first->second;
+  }
+
+  uint32_t intern(const Definition &Def) {
+    const auto Res = Defs.try_emplace(Def, Defs.size());
+    if (Res.second) {
+      DefTable.push_back(Def);
+    }
+    return Res.first->second;
+  }
+
+  llvm::json::Value toJSON(const Location &) const;
+
+  const bool KeepPC;
+  llvm::StringMap<uint32_t> Strings;
+  absl::flat_hash_map<Location, uint32_t> Locations;
+  absl::flat_hash_map<Definition, uint32_t> Defs;
+  std::vector<llvm::StringRef> StringTable;
+  std::vector<Location> LocationTable;
+  std::vector<Definition> DefTable;
+};
+
+/// The def-use pairs covered by a single trace. IDs are local to the trace's
+/// own interner, so must be merged (see `Interner::merge`) before they are
+/// compared with other traces' pairs
+struct TraceDefUses {
+  Interner IDs;
+  std::vector<uint64_t> DefUses;
+};
+
+//
+// Aliases
+//
+
+using DefUseSet = absl::flat_hash_set<uint64_t>;
+
+//
+// Helper functions
+//
+
+/// Parse the def-use pairs covered by a single trace (keeping use PCs if
+/// `KeepPC` is true). Streamed traces may contain the same def multiple times,
+/// so the pairs may contain duplicates. The raw coverage buffer is released
+/// once parsed
+llvm::Expected<TraceDefUses> parseDefUses(RawCoverage &, bool KeepPC = true);
+
+/// Accumulate def-use coverage over all testcases (in testcase order). Traces
+/// are parsed in parallel (using the given number of threads)
+llvm::Expected<TestcaseCoverages> accumulateDefUseCoverage(RawCoverages &,
+                                                           unsigned = 0);
+
+#endif // DUA_COMMON_H
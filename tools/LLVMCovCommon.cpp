@@ -0,0 +1,321 @@
+//===-- LLVMCovCommon.cpp - Common code for region coverage -----*- C++ -*-===//
+///
+/// \file
+/// Common code for Clang source-based (region) coverage tools.
+///
+//===----------------------------------------------------------------------===//
+
+#include <deque>
+#include <future>
+
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ProfileData/Coverage/CoverageMappingReader.h>
+#include <llvm/ProfileData/InstrProf.h>
+#include <llvm/ProfileData/InstrProfReader.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/NativeFormatting.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "fuzzalloc/Streams.h"
+
+#include "LLVMCovCommon.h"
+
+using namespace llvm;
+
+//
+// Coverage accumulator
+//
+
+Expected<CoverageAccumulator>
+CoverageAccumulator::create(const StringRef &Target) {
+  auto BufOrErr = MemoryBuffer::getFile(Target);
+  if (const auto &EC = BufOrErr.getError()) {
+    return errorCodeToError(EC);
+  }
+
+  SmallVector<std::unique_ptr<MemoryBuffer>, 4> Buffers;
+  auto CovReadersOrErr = coverage::BinaryCoverageReader::create(
+      BufOrErr.get()->getMemBufferRef(), "", Buffers);
+  if (auto E = CovReadersOrErr.takeError()) {
+    return std::move(E);
+  }
+
+  CoverageAccumulator Accum;
+
+  // Don't create records for (filenames, function) pairs we've already seen
+  // (consistent with `CoverageMapping::load`)
+  DenseSet<std::pair<uint64_t, uint64_t>> Seen;
+  size_t NumRegions = 0;
+
+  for (auto &Reader : *CovReadersOrErr) {
+    for (auto RecordOrErr : *Reader) {
+      if (auto E = RecordOrErr.takeError()) {
+        return std::move(E);
+      }
+      const auto &Record = *RecordOrErr;
+      if (Record.MappingRegions.empty()) {
+        continue;
+      }
+
+      const auto NameHash =
+          IndexedInstrProf::ComputeHash(Record.FunctionName);
+      const uint64_t FilenamesHash = hash_combine_range(
+          Record.Filenames.begin(), Record.Filenames.end());
+      if (!Seen.insert({FilenamesHash, NameHash}).second) {
+        continue;
+      }
+      if (!Accum.FunctionIdx
+               .try_emplace({NameHash, Record.FunctionHash},
+                            Accum.Functions.size())
+               .second) {
+        continue;
+      }
+
+      auto &F = Accum.Functions.emplace_back();
+      F.Name = Record.FunctionName.str();
+      F.Expressions.assign(Record.Expressions.begin(),
+                           Record.Expressions.end());
+      F.Entry = Record.MappingRegions.front().Count;
+      F.FirstRegion = NumRegions;
+      for (const auto &R : Record.MappingRegions) {
+        if (R.Kind == coverage::CounterMappingRegion::CodeRegion) {
+          const auto &File =
+              R.FileID < Record.Filenames.size() ? Record.Filenames[R.FileID]
+                                                 : StringRef();
+          F.CodeRegions.push_back(R.Count);
+          F.Locations.push_back({Accum.Files.insert(File).first->getKey(),
+                                 R.LineStart, R.ColumnStart, R.LineEnd,
+                                 R.ColumnEnd});
+        }
+      }
+      NumRegions += F.CodeRegions.size();
+    }
+  }
+
+  return std::move(Accum);
+}
+
+Expected<CoverageAccumulator::ProfileCounts>
+CoverageAccumulator::readProfile(const MemoryBufferRef &Buf) const {
+  auto ProfReaderOrErr = InstrProfReader::create(
+      MemoryBuffer::getMemBuffer(Buf, /*RequiresNullTerminator=*/false));
+  if (auto E = ProfReaderOrErr.takeError()) {
+    return std::move(E);
+  }
+  const auto &ProfReader = std::move(*ProfReaderOrErr);
+
+  ProfileCounts Counts;
+  for (const auto &Func : *ProfReader) {
+    // Ignore functions without a coverage mapping (or with a mismatched
+    // hash)
+    const auto It = FunctionIdx.find(
+        {IndexedInstrProf::ComputeHash(Func.Name), Func.Hash});
+    if (It == FunctionIdx.end()) {
+      continue;
+    }
+    if (none_of(Func.Counts, [](uint64_t C) { return C > 0; })) {
+      continue;
+    }
+    Counts.emplace_back(It->second, Func.Counts);
+  }
+
+  if (ProfReader->hasError()) {
+    return ProfReader->getError();
+  }
+
+  return Counts;
+}
+
+void CoverageAccumulator::add(const ProfileCounts &Counts) {
+  for (const auto &[Idx, FuncCounts] : Counts) {
+    auto &F = Functions[Idx];
+
+    if (F.Counts.empty()) {
+      F.Counts.resize(FuncCounts.size());
+    } else if (F.Counts.size() != FuncCounts.size()) {
+      continue;
+    }
+
+    for (unsigned I = 0; I < FuncCounts.size(); ++I) {
+      F.Counts[I] = SaturatingAdd(F.Counts[I], FuncCounts[I]);
+    }
+
+    if (!F.Dirty) {
+      F.Dirty = true;
+      Dirty.push_back(Idx);
+    }
+  }
+}
+
+void CoverageAccumulator::flush() {
+  for (const auto Idx : Dirty) {
+    auto &F = Functions[Idx];
+    update(F);
+    F.Dirty = false;
+  }
+  Dirty.clear();
+}
+
+Error CoverageAccumulator::addProfile(const MemoryBufferRef &Buf) {
+  auto CountsOrErr = readProfile(Buf);
+  if (auto E = CountsOrErr.takeError()) {
+    return E;
+  }
+  add(*CountsOrErr);
+  flush();
+
+  return Error::success();
+}
+
+void CoverageAccumulator::reset() {
+  for (auto &F : Functions) {
+    F.Counts.clear();
+    F.Covered = 0;
+    F.Dirty = false;
+  }
+  Dirty.clear();
+  Count = 0;
+}
+
+void CoverageAccumulator::update(FunctionCoverage &F) {
+  uint64_t Covered = 0;
+  visitCovered(F, [&](size_t) { Covered++; });
+
+  Count = Count - F.Covered + Covered;
+  F.Covered = Covered;
+}
+
+void CoverageAccumulator::visitCovered(const FunctionCoverage &F,
+                                       function_ref<void(size_t)> Visit) {
+  const coverage::CounterMappingContext Ctx(F.Expressions, F.Counts);
+  const auto evaluate = [&](const coverage::Counter &C) -> uint64_t {
+    auto ValOrErr = Ctx.evaluate(C);
+    if (!ValOrErr) {
+      consumeError(ValOrErr.takeError());
+      return 0;
+    }
+    return *ValOrErr;
+  };
+
+  // This function was never executed
+  if (F.Counts.empty() || evaluate(F.Entry) == 0) {
+    return;
+  }
+
+  for (size_t I = 0; I < F.CodeRegions.size(); ++I) {
+    if (evaluate(F.CodeRegions[I]) > 0) {
+      Visit(I);
+    }
+  }
+}
+
+SparseBitVector<> CoverageAccumulator::covered() const {
+  SparseBitVector<> Covered;
+  for (const auto &F : Functions) {
+    visitCovered(F, [&](size_t I) { Covered.set(F.FirstRegion + I); });
+  }
+  return Covered;
+}
+
+json::Value CoverageAccumulator::toJSON(size_t ID) const {
+  // Find the function containing the code region
+  const auto It = std::prev(partition_point(
+      Functions, [&](const auto &F) { return F.FirstRegion <= ID; }));
+  const auto &Loc = It->Locations[ID - It->FirstRegion];
+  return {Loc.File,        It->Name,     Loc.LineStart,
+          Loc.ColumnStart, Loc.LineEnd, Loc.ColumnEnd};
+}
+
+//
+// Helper functions
+//
+
+Expected<TestcaseCoverages> accumulateRegionCoverage(
+    RawCoverages &Covs,      ///< Raw coverage (in testcase order)
+    const StringRef &Target, ///< Clang source-code-instrumented target program
+    unsigned NumThreads      ///< Number of simultaneous threads
+) {
+  const auto NumCovFiles = Covs.size();
+
+  // Load the target's coverage mapping
+  auto AccumOrErr = CoverageAccumulator::create(Target);
+  if (auto E = AccumOrErr.takeError()) {
+    return std::move(E);
+  }
+  auto &Accum = *AccumOrErr;
+
+  TestcaseCoverages TestcaseCovs;
+  TestcaseCovs.reserve(NumCovFiles);
+
+  //
+  // Parse llvm-cov coverage. Raw profiles are read in parallel, but added in
+  // testcase order (so that coverage accumulates over time). At most `Window`
+  // read profiles are buffered waiting to be added
+  //
+
+  ThreadPool Pool(hardware_concurrency(NumThreads));
+  const size_t Window = 2 * Pool.getThreadCount();
+  std::vector<Optional<Expected<CoverageAccumulator::ProfileCounts>>> Parsed(
+      Window);
+  std::deque<std::shared_future<void>> Pending;
+  size_t Next = 0;
+
+  const auto Submit = [&]() {
+    const auto Idx = Next++;
+    Pending.push_back(Pool.async([&, Idx]() {
+      auto &RawCov = Covs[Idx];
+      auto BufOrErr = RawCov.load();
+      if (auto E = BufOrErr.takeError()) {
+        Parsed[Idx % Window] = std::move(E);
+        return;
+      }
+      Parsed[Idx % Window] = Accum.readProfile(*BufOrErr);
+      RawCov.Buf.reset();
+    }));
+  };
+
+  while (Next < std::min(Window, NumCovFiles)) {
+    Submit();
+  }
+
+  for (size_t Idx = 0; Idx < NumCovFiles; ++Idx) {
+    const auto &CovFile = Covs[Idx].Path;
+
+    Pending.front().wait();
+    Pending.pop_front();
+    auto CountsOrErr = std::move(*Parsed[Idx % Window]);
+    Parsed[Idx % Window].reset();
+
+    // The slot is free, so read the next profile
+    if (Next < NumCovFiles) {
+      Submit();
+    }
+
+    if (auto E = CountsOrErr.takeError()) {
+      warning_stream() << '`' << CovFile << "`: " << E << ". Skipping...\n";
+      continue;
+    }
+    Accum.add(*CountsOrErr);
+    Accum.flush();
+
+    const auto Count = Accum.count();
+    TestcaseCovs.emplace_back(sys::path::filename(CovFile).str(), Count);
+
+    if (Idx % ((NumCovFiles + (10 - 1)) / 10) == 0) {
+      status_stream() << "  ";
+      write_double(outs(), static_cast<float>(Idx) / NumCovFiles,
+                   FloatStyle::Percent);
+      outs() << " raw profiles parsed (count = " << Count << ")\r";
+    }
+  }
+  outs() << '\n';
+
+  return TestcaseCovs;
+}
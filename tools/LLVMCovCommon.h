@@ -0,0 +1,120 @@
+//===-- LLVMCovCommon.h - Common code for region coverage -------*- C++ -*-===//
+///
+/// \file
+/// Common code for Clang source-based (region) coverage tools.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_COV_COMMON_H
+#define LLVM_COV_COMMON_H
+
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SparseBitVector.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/ProfileData/Coverage/CoverageMapping.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "CovJSONCommon.h"
+
+//
+// Classes
+//
+
+/// A code region's source range
+struct RegionLocation {
+  llvm::StringRef File;
+  unsigned LineStart;
+  unsigned ColumnStart;
+  unsigned LineEnd;
+  unsigned ColumnEnd;
+};
+
+/// A function's coverage mapping and its accumulated counters
+struct FunctionCoverage {
+  std::string Name;
+  std::vector<llvm::coverage::CounterExpression> Expressions;
+  llvm::coverage::Counter Entry; ///< Function entry counter
+  std::vector<llvm::coverage::Counter> CodeRegions; ///< Code region counters
+  std::vector<RegionLocation> Locations; ///< Code region source ranges
+  size_t FirstRegion; ///< ID of the function's first code region
+  std::vector<uint64_t> Counts; ///< Accumulated counter values
+  uint64_t Covered = 0;         ///< Number of covered regions
+  bool Dirty = false; ///< Counters changed since the function was last counted
+};
+
+/// Accumulates region coverage over raw profiles. The target's coverage mapping
+/// is parsed once, and each raw profile's counters are added to a running
+/// per-function counter array. Because counter expressions are linear and
+/// counters are non-negative, a region is covered by the accumulated counters
+/// iff it is covered by at least one profile
+class CoverageAccumulator {
+public:
+  /// A raw profile's counters, for each function with a coverage mapping
+  using ProfileCounts = std::vector<std::pair<size_t, std::vector<uint64_t>>>;
+
+  /// Load the coverage mapping from the target
+  static llvm::Expected<CoverageAccumulator> create(const llvm::StringRef &);
+
+  /// Read a raw profile's counters. This does not modify the accumulated
+  /// counters, so profiles can be read in parallel
+  llvm::Expected<ProfileCounts>
+  readProfile(const llvm::MemoryBufferRef &) const;
+
+  /// Add a raw profile's counters. Functions are only recounted on `flush`
+  void add(const ProfileCounts &);
+
+  /// Recount the functions whose counters changed
+  void flush();
+
+  /// Add a raw profile's counters
+  llvm::Error addProfile(const llvm::MemoryBufferRef &);
+
+  /// Reset the accumulated counters
+  void reset();
+
+  /// Number of covered code regions
+  uint64_t count() const { return Count; }
+
+  /// Get the code regions covered by the accumulated counters. Code regions
+  /// are numbered (by the target's coverage mapping) in function order, so IDs
+  /// are stable across resets
+  llvm::SparseBitVector<> covered() const;
+
+  /// Convert a code region (numbered as in `covered`) to JSON
+  llvm::json::Value toJSON(size_t) const;
+
+private:
+  CoverageAccumulator() = default;
+
+  /// Recount a function's covered code regions
+  void update(FunctionCoverage &);
+
+  /// Call `Visit` with the index of each of a function's covered code regions
+  static void visitCovered(const FunctionCoverage &,
+                           llvm::function_ref<void(size_t)>);
+
+  llvm::StringSet<> Files; ///< Source file names (referenced by locations)
+  std::vector<FunctionCoverage> Functions;
+  llvm::DenseMap<std::pair<uint64_t, uint64_t>, size_t> FunctionIdx;
+  std::vector<size_t> Dirty; ///< Functions to recount
+  uint64_t Count = 0;
+};
+
+//
+// Helper functions
+//
+
+/// Accumulate region coverage over all testcases (in testcase order), using
+/// the coverage mapping in the given target
+llvm::Expected<TestcaseCoverages>
+accumulateRegionCoverage(RawCoverages &, const llvm::StringRef &,
+                         unsigned = 0);
+
+#endif // LLVM_COV_COMMON_H
@@ -0,0 +1,135 @@
+//===-- combined-cov-json.cpp - Region and DUA coverage --------*- C++ -*-===//
+///
+/// \file
+/// Generate both region and def-use coverage over time by replaying sampled
+/// testcases (once) through a binary instrumented with both Clang's
+/// source-based coverage and the tracer.
+///
+//===----------------------------------------------------------------------===//
+
+#include <string.h>
+
+#include <vector>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "fuzzalloc/Streams.h"
+
+#include "CovJSONCommon.h"
+#include "DUACommon.h"
+#include "LLVMCovCommon.h"
+
+using namespace llvm;
+
+namespace {
+//
+// Command-line options
+//
+
+static cl::OptionCategory CombinedCovJSON("Combined coverage options");
+
+static cl::opt<std::string>
+    QueueDir("i", cl::desc("Queue directory (containing fuzzer test cases)"),
+             cl::value_desc("path"), cl::Required, cl::cat(CombinedCovJSON));
+static cl::opt<std::string>
+    OutDUAJSON("dua-o", cl::desc("Output def-use coverage JSON"),
+               cl::value_desc("path"), cl::Required, cl::cat(CombinedCovJSON));
+static cl::opt<std::string>
+    OutLLVMJSON("llvm-o", cl::desc("Output region coverage JSON"),
+                cl::value_desc("path"), cl::Required,
+                cl::cat(CombinedCovJSON));
+static cl::opt<unsigned> NumThreads("j", cl::desc("Number of threads"),
+                                    cl::value_desc("N"), cl::init(0),
+                                    cl::cat(CombinedCovJSON));
+static cl::opt<bool>
+    UseForkServer("forkserver",
+                  cl::desc("Replay testcases through the coverage runtime's "
+                           "fork server"),
+                  cl::cat(CombinedCovJSON));
+static cl::opt<std::string> Target(cl::Positional, cl::desc("<target>"),
+                                   cl::Required, cl::cat(CombinedCovJSON));
+static cl::list<std::string> TargetArgs(cl::ConsumeAfter, cl::desc("[...]"),
+                                        cl::cat(CombinedCovJSON));
+
+//
+// Global variables
+//
+
+static const ExitOnError ExitOnErr("combined-cov-json: ");
+
+/// The tracer writes its trace alongside the raw profile, with this suffix
+static constexpr char kTraceSuffix[] = ".trace";
+} // anonymous namespace
+
+//
+// The main function
+//
+
+int main(int argc, char *argv[]) {
+  // Parse command-line arguments
+  cl::HideUnrelatedOptions(CombinedCovJSON);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "Generate region and def-use coverage over time by replaying sampled "
+      "test cases (once) through a binary instrumented with both source-based "
+      "coverage and the tracer\n");
+
+  if (!sys::fs::is_directory(QueueDir)) {
+    error_stream() << QueueDir << " is an invalid directory\n";
+    return 1;
+  }
+
+  ReplayOptions Opts;
+  Opts.Target = Target;
+  Opts.TargetArgs = TargetArgs;
+  Opts.NumThreads = NumThreads;
+  Opts.ForkServer = UseForkServer;
+
+  // Collect raw coverage. Each testcase produces both a raw profile and a trace
+  SmallString<16> CovDir;
+  auto Covs = ExitOnErr(replayQueue(Opts, QueueDir, CovDir));
+
+  RawCoverages Profiles, Traces;
+  for (auto &Cov : Covs) {
+    if (StringRef(Cov.Path).endswith(kTraceSuffix)) {
+      Traces.push_back(std::move(Cov));
+    } else {
+      Profiles.push_back(std::move(Cov));
+    }
+  }
+  success_stream() << Profiles.size() << " raw profiles and " << Traces.size()
+                   << " traces generated\n";
+
+  // Accumulate def-use coverage. Testcases are named after their trace, so the
+  // trace suffix is removed
+  status_stream() << "Accumulating " << Traces.size() << " traces...\n";
+  const auto &TraceCov =
+      ExitOnErr(accumulateDefUseCoverage(Traces, NumThreads));
+  TestcaseCoverages DUACov;
+  DUACov.reserve(TraceCov.size());
+  for (const auto &Cov : TraceCov) {
+    DUACov.emplace_back(StringRef(Cov.Path).drop_back(strlen(kTraceSuffix)),
+                        Cov.Count);
+  }
+
+  // Accumulate region coverage
+  status_stream() << "Accumulating " << Profiles.size()
+                  << " raw profiles...\n";
+  const auto &LLVMCov =
+      ExitOnErr(accumulateRegionCoverage(Profiles, Target, NumThreads));
+
+  sys::fs::remove_directories(CovDir);
+  success_stream() << "Coverage accumulation complete\n";
+
+  // Write to JSON
+  status_stream() << "Writing def-use coverage to " << OutDUAJSON << "...\n";
+  ExitOnErr(writeJSON(OutDUAJSON, DUACov));
+  status_stream() << "Writing region coverage to " << OutLLVMJSON << "...\n";
+  ExitOnErr(writeJSON(OutLLVMJSON, LLVMCov));
+
+  return 0;
+}
@@ -0,0 +1,284 @@
+//===-- dua-cmin.cpp - Def-use coverage corpus minimization -----*- C++ -*-===//
+///
+/// \file
+/// Minimize a fuzzer queue while preserving every def-use pair covered by the
+/// queue. Def-use pairs are collected exactly (by replaying the queue through a
+/// tracer-instrumented binary), rather than through the (lossy) AFL bitmap.
+///
+//===----------------------------------------------------------------------===//
+
+#include <queue>
+#include <vector>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SparseBitVector.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "absl/container/flat_hash_map.h"
+
+#include "fuzzalloc/Streams.h"
+
+#include "CovJSONCommon.h"
+#include "DUACommon.h"
+
+using namespace llvm;
+
+namespace {
+//
+// Classes
+//
+
+/// A testcase's def-use coverage. Def-use pairs are densely numbered, so the
+/// covered pairs are stored as a compressed bitset
+struct TestcaseDefUses {
+  std::string Path;          ///< Testcase path
+  uint64_t Size;             ///< Testcase size (in bytes)
+  SparseBitVector<> DefUses; ///< Covered def-use pairs
+};
+
+/// A candidate testcase in the greedy set cover
+struct Candidate {
+  uint64_t Gain; ///< Number of def-use pairs not yet covered (upper bound)
+  uint64_t Size; ///< Testcase size (in bytes)
+  size_t Idx;    ///< Testcase index
+
+  /// Prefer larger gains, then smaller testcases, then earlier testcases
+  bool operator<(const Candidate &Other) const {
+    if (Gain != Other.Gain) {
+      return Gain < Other.Gain;
+    }
+    if (Size != Other.Size) {
+      return Size > Other.Size;
+    }
+    return Idx > Other.Idx;
+  }
+};
+
+//
+// Command-line options
+//
+
+static cl::OptionCategory DUACMin("DUA corpus minimization options");
+
+static cl::opt<std::string>
+    QueueDir("i", cl::desc("Queue directory (containing fuzzer test cases)"),
+             cl::value_desc("path"), cl::Required, cl::cat(DUACMin));
+static cl::opt<std::string>
+    OutDir("o", cl::desc("Output directory (for the minimized corpus)"),
+           cl::value_desc("path"), cl::Required, cl::cat(DUACMin));
+static cl::opt<unsigned> NumThreads("j", cl::desc("Number of threads"),
+                                    cl::value_desc("N"), cl::init(0),
+                                    cl::cat(DUACMin));
+static cl::opt<bool>
+    Persistent("persistent",
+               cl::desc("Replay testcases in persistent mode (the target must "
+                        "be linked with the tracer replay main)"),
+               cl::cat(DUACMin));
+static cl::opt<bool>
+    UseForkServer("forkserver",
+                  cl::desc("Replay testcases through the coverage runtime's "
+                           "fork server"),
+                  cl::cat(DUACMin));
+static cl::opt<bool>
+    UseShm("shm",
+           cl::desc("Replay testcases through the coverage runtime's fork "
+                    "server, collecting coverage through shared memory"),
+           cl::cat(DUACMin));
+static cl::opt<std::string>
+    CacheDir("cache",
+             cl::desc("Coverage cache directory (only testcases not already "
+                      "in the cache are replayed)"),
+             cl::value_desc("path"), cl::cat(DUACMin));
+static cl::opt<std::string> Target(cl::Positional, cl::desc("<target>"),
+                                   cl::Required, cl::cat(DUACMin));
+static cl::list<std::string> TargetArgs(cl::ConsumeAfter, cl::desc("[...]"),
+                                        cl::cat(DUACMin));
+
+//
+// Global variables
+//
+
+static const ExitOnError ExitOnErr("dua-cmin: ");
+
+//
+// Helper functions
+//
+
+/// Collect the def-use pairs covered by each testcase. Def-use pair IDs are
+/// renumbered densely (in the order first seen), so that they can be stored in
+/// compressed bitsets
+static std::vector<TestcaseDefUses> collectDefUses(
+    RawCoverages &Covs, ///< Raw coverage (in testcase order)
+    unsigned NumThreads ///< Number of parser threads
+) {
+  const auto NumCovFiles = Covs.size();
+
+  Interner IDs;
+  std::vector<Optional<Expected<TraceDefUses>>> Parsed(NumCovFiles);
+
+  ThreadPool Pool(hardware_concurrency(NumThreads));
+  for (size_t Idx = 0; Idx < NumCovFiles; ++Idx) {
+    Pool.async([&, Idx]() { Parsed[Idx] = parseDefUses(Covs[Idx]); });
+  }
+  Pool.wait();
+
+  absl::flat_hash_map<uint64_t, unsigned> DenseIDs;
+  std::vector<TestcaseDefUses> Testcases;
+  Testcases.reserve(NumCovFiles);
+
+  for (size_t Idx = 0; Idx < NumCovFiles; ++Idx) {
+    const auto &CovFile = Covs[Idx].Path;
+
+    auto TraceOrErr = std::move(*Parsed[Idx]);
+    Parsed[Idx].reset();
+    if (auto E = TraceOrErr.takeError()) {
+      warning_stream() << '`' << CovFile << "`: " << E << ". Skipping...\n";
+      continue;
+    }
+
+    SmallString<128> Path(QueueDir);
+    sys::path::append(Path, sys::path::filename(CovFile));
+
+    sys::fs::file_status Status;
+    if (const auto EC = sys::fs::status(Path, Status)) {
+      warning_stream() << '`' << Path << "`: " << EC.message()
+                       << ". Skipping...\n";
+      continue;
+    }
+
+    TestcaseDefUses TC{Path.str().str(), Status.getSize(), {}};
+    for (const auto DefUse : IDs.merge(std::move(*TraceOrErr))) {
+      const auto It = DenseIDs.try_emplace(DefUse, DenseIDs.size()).first;
+      TC.DefUses.set(It->second);
+    }
+    Testcases.push_back(std::move(TC));
+  }
+
+  return Testcases;
+}
+
+/// Greedily select testcases until all def-use pairs are covered. A testcase's
+/// gain can only decrease as testcases are selected, so gains are recomputed
+/// lazily (only when a testcase reaches the top of the queue)
+static std::vector<size_t>
+minimize(const std::vector<TestcaseDefUses> &Testcases) {
+  std::priority_queue<Candidate> Queue;
+  for (size_t Idx = 0; Idx < Testcases.size(); ++Idx) {
+    const auto &TC = Testcases[Idx];
+    if (!TC.DefUses.empty()) {
+      Queue.push({TC.DefUses.count(), TC.Size, Idx});
+    }
+  }
+
+  SparseBitVector<> Covered;
+  std::vector<size_t> Selected;
+
+  while (!Queue.empty()) {
+    auto Cand = Queue.top();
+    Queue.pop();
+
+    auto Uncovered = Testcases[Cand.Idx].DefUses;
+    Uncovered.intersectWithComplement(Covered);
+    const auto Gain = Uncovered.count();
+    if (Gain == 0) {
+      continue;
+    }
+
+    // If the gain is stale, requeue the testcase (unless it is still the best)
+    if (Gain < Cand.Gain) {
+      Cand.Gain = Gain;
+      if (!Queue.empty() && Cand < Queue.top()) {
+        Queue.push(Cand);
+        continue;
+      }
+    }
+
+    Covered |= Uncovered;
+    Selected.push_back(Cand.Idx);
+  }
+
+  llvm::sort(Selected);
+  return Selected;
+}
+} // anonymous namespace
+
+//
+// The main function
+//
+
+int main(int argc, char *argv[]) {
+  // Parse command-line arguments
+  cl::HideUnrelatedOptions(DUACMin);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "Minimize a queue while preserving def-use coverage, by replaying the "
+      "queue through a tracer-instrumented binary\n");
+
+  if (!sys::fs::is_directory(QueueDir)) {
+    error_stream() << QueueDir << " is an invalid directory\n";
+    return 1;
+  }
+  if (const auto EC = sys::fs::create_directories(OutDir)) {
+    error_stream() << "Unable to create " << OutDir << ": " << EC.message()
+                   << '\n';
+    return 1;
+  }
+
+  ReplayOptions Opts;
+  Opts.Target = Target;
+  Opts.TargetArgs = TargetArgs;
+  Opts.NumThreads = NumThreads;
+  Opts.Persistent = Persistent;
+  Opts.ForkServer = UseForkServer;
+  Opts.Shm = UseShm;
+  Opts.CacheDir = CacheDir;
+
+  // Collect raw coverage
+  SmallString<16> CovDir;
+  auto Covs = ExitOnErr(replayQueue(Opts, QueueDir, CovDir));
+  success_stream() << Covs.size() << " raw profiles generated\n";
+
+  // Collect def-use pairs
+  status_stream() << "Parsing " << Covs.size() << " raw profiles...\n";
+  const auto Testcases = collectDefUses(Covs, NumThreads);
+  if (!CovDir.empty()) {
+    sys::fs::remove_directories(CovDir);
+  }
+
+  // Minimize
+  status_stream() << "Minimizing " << Testcases.size() << " testcases...\n";
+  const auto Selected = minimize(Testcases);
+
+  SparseBitVector<> Covered;
+  uint64_t InSize = 0, OutSize = 0;
+  for (const auto &TC : Testcases) {
+    Covered |= TC.DefUses;
+    InSize += TC.Size;
+  }
+
+  // Copy the minimized corpus
+  for (const auto Idx : Selected) {
+    const auto &TC = Testcases[Idx];
+    SmallString<128> OutPath(OutDir);
+    sys::path::append(OutPath, sys::path::filename(TC.Path));
+    if (const auto EC = sys::fs::copy_file(TC.Path, OutPath)) {
+      error_stream() << "Unable to copy " << TC.Path << ": " << EC.message()
+                     << '\n';
+      return 1;
+    }
+    OutSize += TC.Size;
+  }
+
+  success_stream() << "Minimized " << Testcases.size() << " testcases ("
+                   << InSize << " bytes) to " << Selected.size()
+                   << " testcases (" << OutSize << " bytes) covering "
+                   << Covered.count() << " def-use pairs\n";
+
+  return 0;
+}
@@ -0,0 +1,366 @@
+//===-- dua-cov-diff.cpp - Compare def-use coverage of queues ---*- C++ -*-===//
+///
+/// \file
+/// Compare the def-use coverage of two or more queues (e.g., from different
+/// fuzzer configurations) by replaying them through a tracer-instrumented
+/// binary. Reports the def-use pairs covered by every queue, covered by only
+/// one queue, and covered by one queue but not another. Region coverage can be
+/// compared instead, by replaying the queues through a binary instrumented with
+/// Clang's source-based coverage.
+///
+//===----------------------------------------------------------------------===//
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SparseBitVector.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "absl/container/flat_hash_map.h"
+
+#include "fuzzalloc/Streams.h"
+
+#include "CovJSONCommon.h"
+#include "DUACommon.h"
+#include "LLVMCovCommon.h"
+
+using namespace llvm;
+
+namespace {
+//
+// Command-line options
+//
+
+static cl::OptionCategory DUACovDiff("DUA coverage diff options");
+
+static cl::list<std::string>
+    QueueDirs("i", cl::desc("Queue directories (containing fuzzer test cases)"),
+              cl::value_desc("path"), cl::OneOrMore, cl::cat(DUACovDiff));
+static cl::opt<std::string> OutJSON("o", cl::desc("Output JSON"),
+                                    cl::value_desc("path"), cl::Required,
+                                    cl::cat(DUACovDiff));
+static cl::opt<unsigned> NumThreads("j", cl::desc("Number of threads"),
+                                    cl::value_desc("N"), cl::init(0),
+                                    cl::cat(DUACovDiff));
+static cl::opt<bool>
+    KeepPC("pc",
+           cl::desc("Distinguish uses by program counter (rather than only "
+                    "by source location)"),
+           cl::cat(DUACovDiff));
+static cl::opt<bool>
+    Regions("regions",
+            cl::desc("Compare code region coverage (the target must be "
+                     "compiled with Clang's source-based coverage) rather "
+                     "than def-use coverage"),
+            cl::cat(DUACovDiff));
+static cl::opt<bool>
+    Persistent("persistent",
+               cl::desc("Replay testcases in persistent mode (the target must "
+                        "be linked with the tracer replay main)"),
+               cl::cat(DUACovDiff));
+static cl::opt<bool>
+    UseForkServer("forkserver",
+                  cl::desc("Replay testcases through the coverage runtime's "
+                           "fork server"),
+                  cl::cat(DUACovDiff));
+static cl::opt<bool>
+    UseShm("shm",
+           cl::desc("Replay testcases through the coverage runtime's fork "
+                    "server, collecting coverage through shared memory"),
+           cl::cat(DUACovDiff));
+static cl::opt<std::string>
+    CacheDir("cache",
+             cl::desc("Coverage cache directory (only testcases not already "
+                      "in the cache are replayed)"),
+             cl::value_desc("path"), cl::cat(DUACovDiff));
+static cl::opt<std::string> Target(cl::Positional, cl::desc("<target>"),
+                                   cl::Required, cl::cat(DUACovDiff));
+static cl::list<std::string> TargetArgs(cl::ConsumeAfter, cl::desc("[...]"),
+                                        cl::cat(DUACovDiff));
+
+//
+// Global variables
+//
+
+static const ExitOnError ExitOnErr("dua-cov-diff: ");
+
+//
+// Classes
+//
+
+/// Def-use coverage of a set of queues. Def-use pairs are densely numbered
+/// (across all queues), so each queue's coverage is stored as a compressed
+/// bitset
+class QueueCoverage {
+public:
+  explicit QueueCoverage(bool KeepPC) : IDs(KeepPC) {}
+
+  /// Accumulate the def-use pairs covered by a queue
+  SparseBitVector<> accumulate(RawCoverages &, unsigned);
+
+  /// Convert a set of (densely-numbered) def-use pairs to JSON
+  json::Array toJSON(const SparseBitVector<> &) const;
+
+private:
+  Interner IDs;
+  absl::flat_hash_map<uint64_t, unsigned> DenseIDs;
+  std::vector<uint64_t> DefUses; ///< Maps dense IDs to def-use pair IDs
+};
+
+SparseBitVector<> QueueCoverage::accumulate(RawCoverages &Covs,
+                                            unsigned NumThreads) {
+  const auto NumCovFiles = Covs.size();
+  std::vector<Optional<Expected<TraceDefUses>>> Parsed(NumCovFiles);
+
+  ThreadPool Pool(hardware_concurrency(NumThreads));
+  for (size_t Idx = 0; Idx < NumCovFiles; ++Idx) {
+    Pool.async([&, Idx]() {
+      Parsed[Idx] = parseDefUses(Covs[Idx], IDs.keepsPC());
+    });
+  }
+  Pool.wait();
+
+  SparseBitVector<> Covered;
+  for (size_t Idx = 0; Idx < NumCovFiles; ++Idx) {
+    auto TraceOrErr = std::move(*Parsed[Idx]);
+    Parsed[Idx].reset();
+    if (auto E = TraceOrErr.takeError()) {
+      warning_stream() << '`' << Covs[Idx].Path << "`: " << E
+                       << ". Skipping...\n";
+      continue;
+    }
+
+    for (const auto DefUse : IDs.merge(std::move(*TraceOrErr))) {
+      const auto Res = DenseIDs.try_emplace(DefUse, DenseIDs.size());
+      if (Res.second) {
+        DefUses.push_back(DefUse);
+      }
+      Covered.set(Res.first->second);
+    }
+  }
+
+  return Covered;
+}
+
+json::Array QueueCoverage::toJSON(const SparseBitVector<> &Set) const {
+  json::Array J;
+  for (const auto ID : Set) {
+    J.push_back(IDs.toJSON(DefUses[ID]));
+  }
+  return J;
+}
+
+/// Code region coverage of a set of queues. Code regions are already numbered
+/// by the target's coverage mapping, so each queue's coverage is the set of
+/// code regions covered by its accumulated counters
+class QueueRegionCoverage {
+public:
+  explicit QueueRegionCoverage(CoverageAccumulator &&Accum)
+      : Accum(std::move(Accum)) {}
+
+  /// Accumulate the code regions covered by a queue
+  SparseBitVector<> accumulate(RawCoverages &, unsigned);
+
+  /// Convert a set of code regions to JSON
+  json::Array toJSON(const SparseBitVector<> &) const;
+
+private:
+  CoverageAccumulator Accum;
+};
+
+SparseBitVector<> QueueRegionCoverage::accumulate(RawCoverages &Covs,
+                                                  unsigned NumThreads) {
+  // Coverage is a set, so profiles are added in whatever order they are read
+  Accum.reset();
+  std::mutex AccumLock;
+
+  ThreadPool Pool(hardware_concurrency(NumThreads));
+  for (auto &RawCov : Covs) {
+    Pool.async([&]() {
+      auto BufOrErr = RawCov.load();
+      if (!BufOrErr) {
+        std::scoped_lock SL(AccumLock);
+        warning_stream() << '`' << RawCov.Path << "`: " << BufOrErr.takeError()
+                         << ". Skipping...\n";
+        return;
+      }
+      auto CountsOrErr = Accum.readProfile(*BufOrErr);
+      RawCov.Buf.reset();
+
+      std::scoped_lock SL(AccumLock);
+      if (!CountsOrErr) {
+        warning_stream() << '`' << RawCov.Path
+                         << "`: " << CountsOrErr.takeError()
+                         << ". Skipping...\n";
+        return;
+      }
+      Accum.add(*CountsOrErr);
+    });
+  }
+  Pool.wait();
+  Accum.flush();
+
+  return Accum.covered();
+}
+
+json::Array QueueRegionCoverage::toJSON(const SparseBitVector<> &Set) const {
+  json::Array J;
+  for (const auto ID : Set) {
+    J.push_back(Accum.toJSON(ID));
+  }
+  return J;
+}
+} // anonymous namespace
+
+//
+// The main function
+//
+
+int main(int argc, char *argv[]) {
+  // Parse command-line arguments
+  cl::HideUnrelatedOptions(DUACovDiff);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "Compare the def-use (or region) coverage of queues by replaying them "
+      "through a tracer-instrumented (or source-based coverage) binary\n");
+
+  if (QueueDirs.size() < 2) {
+    error_stream() << "At least two queues are required\n";
+    return 1;
+  }
+  for (const auto &QueueDir : QueueDirs) {
+    if (!sys::fs::is_directory(QueueDir)) {
+      error_stream() << QueueDir << " is an invalid directory\n";
+      return 1;
+    }
+  }
+
+  ReplayOptions Opts;
+  Opts.Target = Target;
+  Opts.TargetArgs = TargetArgs;
+  Opts.NumThreads = NumThreads;
+  Opts.Persistent = Persistent;
+  Opts.ForkServer = UseForkServer;
+  Opts.Shm = UseShm;
+  Opts.CacheDir = CacheDir;
+
+  //
+  // Collect coverage for each queue
+  //
+
+  const auto NumQueues = QueueDirs.size();
+  std::vector<SparseBitVector<>> Covered(NumQueues);
+
+  // Def-use pairs or code regions
+  const StringRef Unit = Regions ? "code regions" : "def-use pairs";
+  const StringRef Key = Regions ? "regions" : "pairs";
+  std::function<SparseBitVector<>(RawCoverages &)> Accumulate;
+  std::function<json::Array(const SparseBitVector<> &)> ToJSON;
+
+  Optional<QueueCoverage> DUACov;
+  Optional<QueueRegionCoverage> RegionCov;
+  if (Regions) {
+    RegionCov.emplace(ExitOnErr(CoverageAccumulator::create(Target)));
+    Accumulate = [&](RawCoverages &Covs) {
+      return RegionCov->accumulate(Covs, NumThreads);
+    };
+    ToJSON = [&](const SparseBitVector<> &Set) {
+      return RegionCov->toJSON(Set);
+    };
+  } else {
+    DUACov.emplace(KeepPC);
+    Accumulate = [&](RawCoverages &Covs) {
+      return DUACov->accumulate(Covs, NumThreads);
+    };
+    ToJSON = [&](const SparseBitVector<> &Set) { return DUACov->toJSON(Set); };
+  }
+
+  for (size_t I = 0; I < NumQueues; ++I) {
+    SmallString<16> CovDir;
+    auto Covs = ExitOnErr(replayQueue(Opts, QueueDirs[I], CovDir));
+    success_stream() << Covs.size() << " raw profiles generated\n";
+
+    status_stream() << "Accumulating " << Covs.size() << " raw profiles...\n";
+    Covered[I] = Accumulate(Covs);
+    if (!CovDir.empty()) {
+      sys::fs::remove_directories(CovDir);
+    }
+    success_stream() << '`' << QueueDirs[I] << "` covers "
+                     << Covered[I].count() << ' ' << Unit << '\n';
+  }
+
+  //
+  // Compare coverage
+  //
+
+  SparseBitVector<> Intersection = Covered[0];
+  for (size_t I = 1; I < NumQueues; ++I) {
+    Intersection &= Covered[I];
+  }
+
+  json::Array JQueues;
+  for (size_t I = 0; I < NumQueues; ++I) {
+    // Covered only by this queue
+    auto Unique = Covered[I];
+    for (size_t J = 0; J < NumQueues; ++J) {
+      if (I != J) {
+        Unique.intersectWithComplement(Covered[J]);
+      }
+    }
+
+    // Covered by this queue but not another
+    json::Array JDiffs;
+    for (size_t J = 0; J < NumQueues; ++J) {
+      if (I == J) {
+        continue;
+      }
+      auto Diff = Covered[I];
+      Diff.intersectWithComplement(Covered[J]);
+      status_stream() << '`' << QueueDirs[I] << "` \\ `" << QueueDirs[J]
+                      << "`: " << Diff.count() << ' ' << Unit << '\n';
+      JDiffs.push_back(json::Object{{"queue", QueueDirs[J]},
+                                    {"count", Diff.count()},
+                                    {Key, ToJSON(Diff)}});
+    }
+
+    status_stream() << '`' << QueueDirs[I] << "` (unique): " << Unique.count()
+                    << ' ' << Unit << '\n';
+    JQueues.push_back(json::Object{
+        {"queue", QueueDirs[I]},
+        {"count", Covered[I].count()},
+        {"unique",
+         json::Object{{"count", Unique.count()}, {Key, ToJSON(Unique)}}},
+        {"differences", std::move(JDiffs)},
+    });
+  }
+  status_stream() << "Intersection: " << Intersection.count() << ' ' << Unit
+                  << '\n';
+
+  json::Object J{
+      {"queues", std::move(JQueues)},
+      {"intersection", json::Object{{"count", Intersection.count()},
+                                    {Key, ToJSON(Intersection)}}},
+  };
+
+  // Write to JSON
+  status_stream() << "Writing coverage diff to " << OutJSON << "...\n";
+
+  std::error_code EC;
+  raw_fd_ostream OS(OutJSON, EC, sys::fs::OF_Text);
+  if (EC) {
+    error_stream() << "Unable to open " << OutJSON << '\n';
+    return 1;
+  }
+  OS << json::Value(std::move(J));
+  OS.flush();
+
+  return 0;
+}
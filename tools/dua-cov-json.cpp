@@ -8,99 +8,87 @@
 
 #include <unistd.h>
 
+#include <mutex>
 #include <vector>
 
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Error.h>
 #include <llvm/Support/FileSystem.h>
-#include <llvm/Support/JSON.h>
-#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/NativeFormatting.h>
 #include <llvm/Support/Path.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
 #include <llvm/Support/raw_ostream.h>
 
-#include "absl/container/flat_hash_map.h"
-#include "absl/container/flat_hash_set.h"
-
 #include "fuzzalloc/Streams.h"
 
 #include "CovJSONCommon.h"
+#include "DUACommon.h"
 
 using namespace llvm;
 
 namespace {
-//
-// Classes
-//
-
-struct Location {
-  const std::string File;
-  const std::string Func;
-  const size_t Line;
-  const size_t Column;
-  const Optional<uintptr_t> PC;
-
-  Location() = delete;
-  Location(const StringRef &File, const StringRef &Func, size_t Line,
-           size_t Column, uintptr_t PC)
-      : File(File.str()), Func(Func.str()), Line(Line), Column(Column), PC(PC) {
-  }
-  Location(const StringRef &File, const StringRef &Func, size_t Line,
-           size_t Column)
-      : File(File.str()), Func(Func.str()), Line(Line), Column(Column),
-        PC(None) {}
-
-  bool operator==(const Location &Other) const {
-    return File == Other.File && Func == Other.Func && Line == Other.Line &&
-           Column == Other.Column && PC == Other.PC;
-  }
-
-  template <typename H> friend H AbslHashValue(H Hash, const Location &Loc) {
-    return H::combine(std::move(Hash), Loc.File, Loc.Func, Loc.Line, Loc.Column,
-                      Loc.PC.getValueOr(0));
-  }
-};
-
-struct Definition {
-  const Location Loc;
-  const std::string Var;
-
-  Definition() = delete;
-  Definition(const Location &Loc, const StringRef &V)
-      : Loc(Loc), Var(V.str()) {}
-
-  bool operator==(const Definition &Other) const {
-    return Loc == Other.Loc && Var == Other.Var;
-  }
-
-  template <typename H> friend H AbslHashValue(H Hash, const Definition &Def) {
-    return H::combine(std::move(Hash), Def.Loc, Def.Var);
-  }
-};
-
-//
-// Aliases
-//
-
-using LocationSet = absl::flat_hash_set<Location>;
-using DefUseMap = absl::flat_hash_map<Definition, LocationSet>;
-
 //
 // Command-line options
 //
 
 static cl::OptionCategory DUACovJSON("DUA coverage options");
 
+static cl::list<std::string> QueueDirs(
+    "i",
+    cl::desc("Queue directory (containing fuzzer test cases). Multiple queues "
+             "(e.g., from different trials) are replayed in batch"),
+    cl::value_desc("path"), cl::OneOrMore, cl::cat(DUACovJSON));
 static cl::opt<std::string>
-    QueueDir("i", cl::desc("Queue directory (containing fuzzer test cases)"),
-             cl::value_desc("path"), cl::Required, cl::cat(DUACovJSON));
-static cl::opt<std::string> OutJSON("o", cl::desc("Output JSON"),
-                                    cl::value_desc("path"), cl::Required,
-                                    cl::cat(DUACovJSON));
+    OutJSON("o",
+            cl::desc("Output JSON (or output directory, if replaying multiple "
+                     "queues)"),
+            cl::value_desc("path"), cl::Required, cl::cat(DUACovJSON));
 static cl::opt<unsigned> NumThreads("j", cl::desc("Number of threads"),
                                     cl::value_desc("N"), cl::init(0),
                                     cl::cat(DUACovJSON));
+static cl::opt<bool>
+    Persistent("persistent",
+               cl::desc("Replay testcases in persistent mode (the target must "
+                        "be linked with the tracer replay main)"),
+               cl::cat(DUACovJSON));
+static cl::opt<bool>
+    UseForkServer("forkserver",
+                  cl::desc("Replay testcases through the coverage runtime's "
+                           "fork server"),
+                  cl::cat(DUACovJSON));
+static cl::opt<bool>
+    UseShm("shm",
+           cl::desc("Replay testcases through the coverage runtime's fork "
+                    "server, collecting coverage through shared memory"),
+           cl::cat(DUACovJSON));
+static cl::opt<std::string>
+    CacheDir("cache",
+             cl::desc("Coverage cache directory (only testcases not already "
+                      "in the cache are replayed)"),
+             cl::value_desc("path"), cl::cat(DUACovJSON));
+static cl::opt<TimestampSource> Timestamps(
+    "timestamps",
+    cl::desc("Accumulate coverage in time buckets, using testcase timestamps "
+             "from:"),
+    cl::values(clEnumValN(TimestampSource::AFL, "afl",
+                          "AFL++ `time:` field in the testcase name"),
+               clEnumValN(TimestampSource::MTime, "mtime",
+                          "Testcase modification time"),
+               clEnumValN(TimestampSource::CSV, "csv",
+                          "CSV file given by -timestamp-csv")),
+    cl::init(TimestampSource::None), cl::cat(DUACovJSON));
+static cl::opt<std::string>
+    TimestampCSV("timestamp-csv",
+                 cl::desc("CSV of (testcase, timestamp in seconds) rows"),
+                 cl::value_desc("path"), cl::cat(DUACovJSON));
+static cl::opt<unsigned> BinSize("bin",
+                                 cl::desc("Time bucket size (in seconds)"),
+                                 cl::value_desc("seconds"), cl::init(60),
+                                 cl::cat(DUACovJSON));
 static cl::opt<std::string> Target(cl::Positional, cl::desc("<target>"),
                                    cl::Required, cl::cat(DUACovJSON));
 static cl::list<std::string> TargetArgs(cl::ConsumeAfter, cl::desc("[...]"),
@@ -116,136 +104,168 @@ static const ExitOnError ExitOnErr("dua-cov-json: ");
 // Helper functions
 //
 
-/// Accumulate coverage over all testcases
-static Expected<TestcaseCoverages> accumulateCoverage(
-    const StringRef &CovDir, ///< Directory containing raw coverage files
-    const StringRef &Target  ///< Clang source-code-instrumented target program
+/// Accumulate coverage over time buckets. Traces in the same bucket are parsed
+/// and merged in parallel (in no particular order)
+static TimeBinCoverages accumulateBinnedCoverage(
+    RawCoverages &Covs,   ///< Raw coverage
+    const TimeBins &Bins, ///< Raw coverage in each time bucket
+    uint64_t BinSize,     ///< Time bucket size (in seconds)
+    unsigned NumThreads   ///< Number of parser threads
 ) {
-  // Get the number of coverage files
-  auto NumCovFilesOrErr = getNumFiles(CovDir);
-  if (auto E = NumCovFilesOrErr.takeError()) {
-    return std::move(E);
-  }
-  const auto NumCovFiles = *NumCovFilesOrErr;
-
-  // Get the actual coverage JSON files
-  auto TestcasesOrErr = getTestcases(CovDir);
-  if (auto E = TestcasesOrErr.takeError()) {
-    return std::move(E);
-  }
+  const auto NumBins = Bins.size();
 
-  // Load the target (for profile instrumentation)
-  auto CovMappingBufOrErr = MemoryBuffer::getFile(Target);
-  if (const auto &EC = CovMappingBufOrErr.getError()) {
-    return errorCodeToError(EC);
-  }
-
-  TestcaseCoverages TestcaseCovs;
-  TestcaseCovs.reserve(NumCovFiles);
+  TimeBinCoverages BinCovs;
+  BinCovs.reserve(NumBins);
 
-  DefUseMap AccumDefUses;
-  DefUseMap DefUses;
-  auto Count = 0;
-
-  //
-  // Parse tracer coverage
-  //
+  Interner IDs;
+  DefUseSet AccumDefUses;
+  std::mutex AccumLock;
+  uint64_t Count = 0;
 
-  for (const auto &CovFileEnum : enumerate(*TestcasesOrErr)) {
-    const auto &CovFile = CovFileEnum.value();
-    DefUses.clear();
+  ThreadPool Pool(hardware_concurrency(NumThreads));
 
-    //
-    // Parse JSON coverage
-    //
+  for (size_t Bin = 0; Bin < NumBins; ++Bin) {
+    for (const auto Idx : Bins[Bin]) {
+      Pool.async([&, Idx]() {
+        auto TraceOrErr = parseDefUses(Covs[Idx]);
 
-    const auto CovOrErr = MemoryBuffer::getFile(CovFile);
-    if (const auto &EC = CovOrErr.getError()) {
-      return errorCodeToError(EC);
+        std::scoped_lock SL(AccumLock);
+        if (auto E = TraceOrErr.takeError()) {
+          warning_stream() << '`' << Covs[Idx].Path << "`: " << E
+                           << ". Skipping...\n";
+          return;
+        }
+        for (const auto DefUse : IDs.merge(std::move(*TraceOrErr))) {
+          if (AccumDefUses.insert(DefUse).second) {
+            Count++;
+          }
+        }
+      });
     }
+    Pool.wait();
 
-    auto CovJSONOrErr = json::parse(CovOrErr.get()->getBuffer());
-    if (auto E = CovJSONOrErr.takeError()) {
-      warning_stream() << '`' << CovFile << "`: " << E << ". Skipping...\n";
-      continue;
+    BinCovs.emplace_back((Bin + 1) * BinSize, Count);
+
+    if (Bin % ((NumBins + (10 - 1)) / 10) == 0) {
+      status_stream() << "  ";
+      write_double(outs(), static_cast<float>(Bin) / NumBins,
+                   FloatStyle::Percent);
+      outs() << " time buckets accumulated (count = " << Count << ")\r";
     }
+  }
+  outs() << '\n';
 
-    assert(CovJSONOrErr->getAsArray());
-    for (const auto &JDUAs : *CovJSONOrErr->getAsArray()) {
-      assert(JDUAs.getAsArray());
-      assert(JDUAs.getAsArray()->size() == 2);
+  return BinCovs;
+}
 
-      const auto &JDef = (*JDUAs.getAsArray())[0];
-      const auto &JUses = (*JDUAs.getAsArray())[1];
+/// Replay several queues (trials) in batch, writing each trial's coverage to
+/// the output directory. Each unique testcase is only replayed (and its trace
+/// parsed) once
+static Error replayBatch(const ReplayOptions &Opts) {
+  if (const auto EC = sys::fs::create_directories(OutJSON)) {
+    return errorCodeToError(EC);
+  }
 
-      // Parse def
-      assert(JDef.getAsArray());
-      assert(JDef.getAsArray()->size() == 2);
+  // Collect raw coverage
+  std::vector<Trial> Trials;
+  SmallString<16> CovDir;
+  auto CovsOrErr = replayTrials(Opts, QueueDirs, Trials, CovDir);
+  if (auto E = CovsOrErr.takeError()) {
+    return E;
+  }
+  auto &Covs = *CovsOrErr;
+  success_stream() << Covs.size() << " raw profiles generated\n";
 
-      assert((*JDef.getAsArray())[0].getAsString());
-      assert((*JDef.getAsArray())[1].getAsArray());
-      assert((*JDef.getAsArray())[1].getAsArray()->size() == 4);
+  // Parse each unique trace
+  status_stream() << "Parsing " << Covs.size() << " raw profiles...\n";
 
-      const auto &JDefLoc = *(*JDef.getAsArray())[1].getAsArray();
+  Interner IDs;
+  std::vector<Optional<Expected<TraceDefUses>>> Parsed(Covs.size());
 
-      const auto &DefVar = (*JDef.getAsArray())[0].getAsString();
-      const auto &DefFile = JDefLoc[0].getAsString();
-      const auto &DefFunc = JDefLoc[1].getAsString();
-      const auto &DefLine = JDefLoc[2].getAsInteger();
-      const auto &DefColumn = JDefLoc[3].getAsInteger();
+  ThreadPool Pool(hardware_concurrency(Opts.NumThreads));
+  for (size_t Idx = 0; Idx < Covs.size(); ++Idx) {
+    Pool.async([&, Idx]() { Parsed[Idx] = parseDefUses(Covs[Idx]); });
+  }
+  Pool.wait();
+  if (!CovDir.empty()) {
+    sys::fs::remove_directories(CovDir);
+  }
 
-      const Location DefLoc(*DefFile, *DefFunc, *DefLine, *DefColumn);
-      const Definition Def(DefLoc, *DefVar);
+  StringMap<std::vector<uint64_t>> DefUses;
+  for (size_t Idx = 0; Idx < Covs.size(); ++Idx) {
+    auto &TraceOrErr = *Parsed[Idx];
+    if (auto E = TraceOrErr.takeError()) {
+      warning_stream() << '`' << Covs[Idx].Path << "`: " << E
+                       << ". Skipping...\n";
+      continue;
+    }
+    DefUses[sys::path::filename(Covs[Idx].Path)] =
+        IDs.merge(std::move(*TraceOrErr));
+    Parsed[Idx].reset();
+  }
+  Parsed.clear();
 
-      // Parse uses (ignore the count)
-      LocationSet Uses;
-      assert(JUses.getAsArray());
-      for (const auto &JUseAndCount : *JUses.getAsArray()) {
-        assert(JUseAndCount.getAsArray());
-        assert(JUseAndCount.getAsArray()->size() == 2);
-        assert((*JUseAndCount.getAsArray())[0].getAsArray());
+  //
+  // Accumulate coverage for each trial
+  //
 
-        // Parse use
-        const auto &JUseLoc = *(*JUseAndCount.getAsArray())[0].getAsArray();
-        assert(JUseLoc.size() == 5);
+  for (const auto &T : Trials) {
+    const auto Out = getTrialOutput(OutJSON, T.QueueDir);
 
-        const auto &UseFile = JUseLoc[0].getAsString();
-        const auto &UseFunc = JUseLoc[1].getAsString();
-        const auto &UseLine = JUseLoc[2].getAsInteger();
-        const auto &UseColumn = JUseLoc[3].getAsInteger();
-        const auto &UsePC = JUseLoc[4].getAsInteger();
+    DefUseSet AccumDefUses;
+    uint64_t Count = 0;
 
-        Uses.emplace(*UseFile, *UseFunc, *UseLine, *UseColumn, *UsePC);
+    const auto Accumulate = [&](size_t Idx) -> bool {
+      const auto It = DefUses.find(T.Hashes[Idx]);
+      if (It == DefUses.end()) {
+        return false;
       }
-
-      DefUses.try_emplace(Def, Uses);
-    }
-
-    //
-    // Calculate coverage
-    //
-
-    for (const auto &[Def, Uses] : DefUses) {
-      for (const auto &Use : Uses) {
-        if (AccumDefUses[Def].emplace(Use).second) {
+      for (const auto DefUse : It->second) {
+        if (AccumDefUses.insert(DefUse).second) {
           Count++;
         }
       }
-    }
-
-    TestcaseCovs.emplace_back(sys::path::filename(CovFile).str(), Count);
+      return true;
+    };
+
+    if (Timestamps == TimestampSource::None) {
+      TestcaseCoverages Cov;
+      for (size_t Idx = 0; Idx < T.Testcases.size(); ++Idx) {
+        if (Accumulate(Idx)) {
+          Cov.emplace_back(T.Testcases[Idx], Count);
+        }
+      }
+      if (auto E = writeJSON(Out, Cov)) {
+        return E;
+      }
+    } else {
+      RawCoverages Testcases;
+      for (const auto &Name : T.Testcases) {
+        Testcases.push_back({Name, nullptr});
+      }
+      auto BinsOrErr = binCoverages(Testcases, T.QueueDir, Timestamps,
+                                    TimestampCSV, BinSize);
+      if (auto E = BinsOrErr.takeError()) {
+        return E;
+      }
 
-    const auto &Idx = CovFileEnum.index();
-    if (Idx % ((NumCovFiles + (10 - 1)) / 10) == 0) {
-      status_stream() << "  ";
-      write_double(outs(), static_cast<float>(Idx) / NumCovFiles,
-                   FloatStyle::Percent);
-      outs() << " raw profiles parsed (count = " << Count << ")\r";
+      TimeBinCoverages Cov;
+      for (size_t Bin = 0; Bin < BinsOrErr->size(); ++Bin) {
+        for (const auto Idx : (*BinsOrErr)[Bin]) {
+          Accumulate(Idx);
+        }
+        Cov.emplace_back((Bin + 1) * BinSize, Count);
+      }
+      if (auto E = writeJSON(Out, Cov)) {
+        return E;
+      }
     }
+
+    success_stream() << '`' << T.QueueDir << "`: " << Count
+                     << " def-use pairs (written to " << Out << ")\n";
   }
-  outs() << '\n';
 
-  return TestcaseCovs;
+  return Error::success();
 }
 } // anonymous namespace
 
@@ -261,29 +281,62 @@ int main(int argc, char *argv[]) {
       "Generate coverage over time by replaying sampled test cases through a "
       "tracer-instrumented binary\n");
 
-  if (!sys::fs::is_directory(QueueDir)) {
-    error_stream() << QueueDir << " is an invalid directory\n";
+  for (const auto &QueueDir : QueueDirs) {
+    if (!sys::fs::is_directory(QueueDir)) {
+      error_stream() << QueueDir << " is an invalid directory\n";
+      return 1;
+    }
+  }
+
+  if (Timestamps == TimestampSource::CSV && TimestampCSV.empty()) {
+    error_stream() << "-timestamps=csv requires -timestamp-csv\n";
     return 1;
   }
 
-  SmallString<16> CovDir;
-  ExitOnErr(
-      errorCodeToError(sys::fs::createUniqueDirectory("coverage", CovDir)));
+  ReplayOptions Opts;
+  Opts.Target = Target;
+  Opts.TargetArgs = TargetArgs;
+  Opts.NumThreads = NumThreads;
+  Opts.Persistent = Persistent;
+  Opts.ForkServer = UseForkServer;
+  Opts.Shm = UseShm;
+  Opts.CacheDir = CacheDir;
+
+  if (QueueDirs.size() > 1) {
+    ExitOnErr(replayBatch(Opts));
+    return 0;
+  }
+  const auto &QueueDir = QueueDirs.front();
 
   // Collect raw coverage
-  const auto NumTestcases = ExitOnErr(getNumFiles(QueueDir));
-  status_stream() << "Generating raw profiles for " << NumTestcases
-                  << " testcases (in `" << QueueDir << "`) using target `"
-                  << Target << "`...\n";
-  ExitOnErr(genCoverage(Target, TargetArgs, QueueDir, CovDir, NumThreads));
-  const auto NumCovFiles = ExitOnErr(getNumFiles(CovDir));
-  success_stream() << NumCovFiles << " raw profiles generated\n";
+  SmallString<16> CovDir;
+  auto Covs = ExitOnErr(replayQueue(Opts, QueueDir, CovDir));
+  success_stream() << Covs.size() << " raw profiles generated\n";
+
+  // Accumulate coverage (over time buckets, if timestamps are available)
+  if (Timestamps != TimestampSource::None) {
+    const auto Bins = ExitOnErr(
+        binCoverages(Covs, QueueDir, Timestamps, TimestampCSV, BinSize));
+    status_stream() << "Accumulating " << Covs.size()
+                    << " raw profiles into " << Bins.size()
+                    << " time buckets...\n";
+    const auto Cov = accumulateBinnedCoverage(Covs, Bins, BinSize, NumThreads);
+    if (!CovDir.empty()) {
+      sys::fs::remove_directories(CovDir);
+    }
+    success_stream() << "Coverage accumulation complete\n";
+
+    status_stream() << "Writing coverage to " << OutJSON << "...\n";
+    ExitOnErr(writeJSON(OutJSON, Cov));
+    return 0;
+  }
 
   // Accumulate coverage
-  status_stream() << "Accumulating " << NumCovFiles << " raw profiles in "
-                  << CovDir << '\n';
-  const auto &Cov = ExitOnErr(accumulateCoverage(CovDir, Target));
-  sys::fs::remove_directories(CovDir);
+  status_stream() << "Accumulating " << Covs.size() << " raw profiles...\n";
+  const auto &Cov = ExitOnErr(accumulateDefUseCoverage(Covs, NumThreads));
+  if (!CovDir.empty()) {
+    sys::fs::remove_directories(CovDir);
+  }
   success_stream() << "Coverage accumulation complete\n";
 
   // Write to JSON
@@ -0,0 +1,608 @@
+//===-- dua-layout.cpp - Collision-free def/use tag layout ------*- C++ -*-===//
+///
+/// \file
+/// Assign def and use site tags so that every statically-feasible def-use chain
+/// maps to a distinct AFL coverage map index.
+///
+/// This operates on a whole-program bitcode file that has already been
+/// instrumented for AFL (with `use` capture). The static def-use chains are
+/// computed with SVF, new tags are assigned, and the tag constants rewritten.
+/// The tag map written by the instrumentation (if any) no longer matches the
+/// rewritten tags, so an updated copy can be written alongside the bitcode.
+///
+//===----------------------------------------------------------------------===//
+
+#include <numeric>
+
+#include <llvm/ADT/BitVector.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/InitializePasses.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "fuzzalloc/Analysis/DefUseChain.h"
+#include "fuzzalloc/Metadata.h"
+#include "fuzzalloc/Streams.h"
+#include "fuzzalloc/fuzzalloc.h"
+
+using namespace llvm;
+
+namespace {
+//
+// Classes
+//
+
+/// A tag constant that can be rewritten
+struct TagSlot {
+  Use *U = nullptr;                 ///< Tag operand (calls and stores)
+  GlobalVariable *GV = nullptr;     ///< Tagged global variable initializer
+  tag_t Tag = kFuzzallocDefaultTag; ///< The new tag
+  std::string Loc; ///< Source location (as recorded in the tag map)
+
+  TagSlot() = default;
+  TagSlot(Use *U) : U(U) {}
+  TagSlot(GlobalVariable *GV) : GV(GV) {}
+
+  /// The tag currently in the module
+  tag_t getTag() const {
+    if (U) {
+      return cast<ConstantInt>(U->get())->getZExtValue();
+    }
+    return cast<ConstantInt>(GV->getInitializer()->getAggregateElement(2))
+        ->getZExtValue();
+  }
+
+  /// Rewrite the tag constant
+  void rewrite(IntegerType *TagTy) const {
+    auto *NewTag = ConstantInt::get(TagTy, Tag);
+    if (U) {
+      U->set(NewTag);
+    } else if (GV) {
+      auto *Init = cast<ConstantStruct>(GV->getInitializer());
+      auto *NewInit = ConstantStruct::get(
+          Init->getType(), {Init->getOperand(0), Init->getOperand(1), NewTag});
+      GV->setInitializer(NewInit);
+    }
+  }
+};
+
+//
+// Command-line options
+//
+
+static cl::OptionCategory Cat("Collision-free def/use tag layout");
+static cl::opt<std::string> BCFilename(cl::Positional, cl::desc("<BC file>"),
+                                       cl::value_desc("path"), cl::Required,
+                                       cl::cat(Cat));
+static cl::opt<std::string> OutBC("o", cl::desc("Output BC file"),
+                                  cl::value_desc("path"), cl::Required,
+                                  cl::cat(Cat));
+static cl::opt<std::string>
+    InTagMap("m",
+             cl::desc("Tag map (written by `-fuzzalloc-tag-map`) to update "
+                      "with the new tags"),
+             cl::value_desc("path"), cl::cat(Cat));
+static cl::opt<std::string> OutTagMap("om", cl::desc("Output tag map"),
+                                      cl::value_desc("path"), cl::cat(Cat));
+static cl::opt<bool> AllowCollisions(
+    "allow-collisions",
+    cl::desc("Write the output even if some def-use chains collide"),
+    cl::cat(Cat));
+
+//
+// Helper functions
+//
+
+/// Serialize a source location, as `[file, func, line, col]`
+static std::string toString(json::Array Loc) {
+  std::string S;
+  raw_string_ostream OS(S);
+  OS << json::Value(std::move(Loc));
+  return OS.str();
+}
+
+/// Source location of a use site (or heap def site). This must match the
+/// location the instrumentation records in the tag map
+static std::string getSrcLocation(const Instruction *I) {
+  const auto &Loc = I->getDebugLoc();
+  if (!Loc) {
+    return toString(json::Array{"", "", 0, 0});
+  }
+
+  auto *SP = getDISubprogram(Loc.getScope());
+  return toString(json::Array{SP->getFile()->getFilename(), SP->getName(),
+                              Loc.getLine(), Loc.getCol()});
+}
+
+/// Source location of a def site. Heap defs are located at the allocation
+/// call, and variables at their debug declaration (as recorded by the
+/// instrumentation)
+static std::string getDefLocation(const DefSite &Def) {
+  if (const auto *CB = dyn_cast<CallBase>(Def.Val)) {
+    return getSrcLocation(CB);
+  }
+
+  const auto *DIVar = Def.DIVar;
+  if (!DIVar) {
+    return toString(json::Array{"", "", 0, 0});
+  }
+
+  const auto &FuncName = [&]() -> StringRef {
+    if (auto *DILocal = dyn_cast<DILocalVariable>(DIVar)) {
+      return getDISubprogram(DILocal->getScope())->getName();
+    }
+    return "";
+  }();
+
+  const auto *Loc = Def.Loc;
+  return toString(json::Array{DIVar->getFilename(), FuncName,
+                              DIVar->getLine(),
+                              Loc && *Loc ? Loc->getCol() : 0});
+}
+
+/// New tags of rewritten sites, keyed by the site's original tag and source
+/// location. Sites on the same source location may share an original tag, so
+/// a key may have several new tags
+using RewrittenTags = StringMap<SmallVector<tag_t, 1>>;
+
+static std::string getSiteKey(tag_t Tag, const StringRef &Loc) {
+  return (Twine(Tag) + " " + Loc).str();
+}
+
+/// Write the tag map with each rewritten site's record updated to its new tag.
+/// Records of sites that were not rewritten are copied unchanged. Returns the
+/// number of updated records, and removes the matched keys from the given maps
+/// (so that the remaining keys are sites without a record)
+static Expected<size_t> writeTagMap(const StringRef &InPath,
+                                    const StringRef &OutPath,
+                                    RewrittenTags &Defs, RewrittenTags &Uses) {
+  auto BufOrErr = MemoryBuffer::getFile(InPath, /*IsText=*/true);
+  if (const auto EC = BufOrErr.getError()) {
+    return errorCodeToError(EC);
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(OutPath, EC, sys::fs::OF_Text);
+  if (EC) {
+    return errorCodeToError(EC);
+  }
+
+  // Modules may be recompiled, appending duplicate records
+  StringSet<> Seen;
+  SmallVector<StringRef, 0> Lines;
+  (*BufOrErr)->getBuffer().split(Lines, '\n', /*MaxSplit=*/-1,
+                                 /*KeepEmpty=*/false);
+
+  StringSet<> Matched;
+  size_t NumUpdated = 0;
+
+  for (size_t I = 0; I < Lines.size(); ++I) {
+    if (!Seen.insert(Lines[I]).second) {
+      continue;
+    }
+
+    const auto MalformedErr = [&]() {
+      return createStringError(inconvertibleErrorCode(),
+                               "%s:%zu: malformed tag map record",
+                               InPath.str().c_str(), I + 1);
+    };
+
+    auto RecordOrErr = json::parse(Lines[I]);
+    if (!RecordOrErr) {
+      consumeError(RecordOrErr.takeError());
+      return MalformedErr();
+    }
+
+    auto *Record = RecordOrErr->getAsObject();
+    const auto *Loc = Record ? Record->getArray("loc") : nullptr;
+    if (!Loc) {
+      return MalformedErr();
+    }
+
+    const auto [Kind, Sites] = [&]() -> std::pair<StringRef, RewrittenTags *> {
+      if (Record->getInteger("def")) {
+        return {"def", &Defs};
+      } else if (Record->getInteger("use")) {
+        return {"use", &Uses};
+      }
+      return {"", nullptr};
+    }();
+    if (!Sites) {
+      return MalformedErr();
+    }
+
+    const auto Key =
+        getSiteKey(*Record->getInteger(Kind), toString(json::Array(*Loc)));
+    const auto It = Sites->find(Key);
+    if (It == Sites->end()) {
+      OS << Lines[I] << '\n';
+      continue;
+    }
+
+    // One record per distinct new tag
+    Matched.insert(Key);
+    SmallVector<tag_t, 1> NewTags(It->second);
+    llvm::sort(NewTags);
+    NewTags.erase(std::unique(NewTags.begin(), NewTags.end()), NewTags.end());
+    for (const auto NewTag : NewTags) {
+      (*Record)[Kind] = NewTag;
+      OS << json::Value(json::Object(*Record)) << '\n';
+    }
+    NumUpdated++;
+  }
+
+  for (const auto &Key : Matched) {
+    Defs.erase(Key.getKey());
+    Uses.erase(Key.getKey());
+  }
+
+  return NumUpdated;
+}
+
+static bool isTagConstant(const Value *V) {
+  return isa<ConstantInt>(V) &&
+         V->getType()->getIntegerBitWidth() == kNumTagBits;
+}
+
+/// Find the tag constant of a tagged def site
+static Optional<TagSlot> getDefTagSlot(Value *Def) {
+  // Heap allocation: the tag is always the first argument. Tags passed through
+  // allocation wrappers (or mixed with an allocation context) are not constant
+  if (auto *CB = dyn_cast<CallBase>(Def)) {
+    if (CB->arg_size() > 0 && isTagConstant(CB->getArgOperand(0))) {
+      return TagSlot(&CB->getArgOperandUse(0));
+    }
+    return None;
+  }
+
+  // Local variable: the tag is stored in the last element of the tagged
+  // alloca's struct
+  if (auto *Alloca = dyn_cast<AllocaInst>(Def)) {
+    for (auto *U : Alloca->users()) {
+      auto *GEP = dyn_cast<GetElementPtrInst>(U);
+      if (!GEP || GEP->getNumIndices() != 2) {
+        continue;
+      }
+      auto *Idx = dyn_cast<ConstantInt>(GEP->getOperand(2));
+      if (!Idx || Idx->getZExtValue() != 2) {
+        continue;
+      }
+      for (auto *GEPUser : GEP->users()) {
+        auto *Store = dyn_cast<StoreInst>(GEPUser);
+        if (Store && Store->getPointerOperand() == GEP &&
+            isTagConstant(Store->getValueOperand())) {
+          return TagSlot(&Store->getOperandUse(0));
+        }
+      }
+    }
+    return None;
+  }
+
+  // Global variable: the tag is the last element of the tagged initializer
+  if (auto *GV = dyn_cast<GlobalVariable>(Def)) {
+    auto *Init = GV->hasInitializer()
+                     ? dyn_cast<ConstantStruct>(GV->getInitializer())
+                     : nullptr;
+    if (Init && Init->getNumOperands() == 3 &&
+        isTagConstant(Init->getOperand(2))) {
+      return TagSlot(GV);
+    }
+    return None;
+  }
+
+  return None;
+}
+
+/// Find the tag constant of an instrumented use site. The use site is
+/// instrumented immediately after the memory access
+static Optional<TagSlot> getUseTagSlot(Value *Use) {
+  auto *Inst = dyn_cast<Instruction>(Use);
+  if (!Inst) {
+    return None;
+  }
+
+  for (auto *I = Inst->getNextNode(); I; I = I->getNextNode()) {
+    if (I->hasMetadata(kFuzzallocInstrumentedUseSiteMD)) {
+      break;
+    }
+
+    auto *CB = dyn_cast<CallBase>(I);
+    auto *Callee = CB ? CB->getCalledFunction() : nullptr;
+    if (!Callee || !Callee->getName().startswith("__afl_hash_def_use")) {
+      continue;
+    }
+
+    // Only the def-use hash is a pure XOR of the def and use tags. The offset
+    // and value hashes depend on runtime values
+    if (Callee->getName() == "__afl_hash_def_use" &&
+        isTagConstant(CB->getArgOperand(0))) {
+      return TagSlot(&CB->getArgOperandUse(0));
+    }
+    break;
+  }
+
+  return None;
+}
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv, "Collision-free def/use tag layout");
+
+  if (InTagMap.empty() != OutTagMap.empty()) {
+    error_stream() << "-m and -om must be given together\n";
+    ::exit(1);
+  }
+
+  // Parse bitcode
+  status_stream() << "Parsing " << BCFilename << "...\n";
+  LLVMContext Ctx;
+  SMDiagnostic Err;
+  auto Mod = parseIRFile(BCFilename, Err, Ctx);
+  if (!Mod) {
+    error_stream() << "Failed to parse `" << BCFilename
+                   << "`: " << Err.getMessage() << '\n';
+    ::exit(1);
+  }
+
+  // Get static def-use chains
+  auto &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+
+  legacy::PassManager PM;
+  auto *DUA = new DefUseChain;
+  PM.add(DUA);
+  PM.run(*Mod);
+
+  const auto &DefUseChains = DUA->getDefUseChains();
+
+  //
+  // Collect rewritable def and use tags
+  //
+
+  SmallVector<TagSlot, 0> DefSlots;
+  SmallVector<TagSlot, 0> UnchainedDefSlots;
+  DenseMap<const Value *, unsigned> UseIdxs;
+  SmallPtrSet<const Value *, 16> FixedUses;
+  SmallVector<TagSlot, 0> UseSlots;
+  SmallVector<SmallVector<unsigned, 4>, 0> UseDefs;
+  size_t NumFixedDefs = 0;
+  size_t NumRuntimePairs = 0;
+
+  status_stream() << "Collecting def/use tags...\n";
+  for (const auto &[Def, Uses] : DefUseChains) {
+    // The tags of these defs are computed at runtime, so their chains may hit
+    // any map index
+    auto DefSlot = getDefTagSlot(const_cast<Value *>(Def.Val));
+    if (!DefSlot) {
+      NumFixedDefs++;
+      NumRuntimePairs += Uses.size();
+      continue;
+    }
+    DefSlot->Loc = getDefLocation(Def);
+
+    SmallVector<unsigned, 16> DefUseIdxs;
+    for (const auto &Use : Uses) {
+      auto It = UseIdxs.find(Use.Val);
+      if (It == UseIdxs.end()) {
+        auto UseSlot = getUseTagSlot(const_cast<Value *>(Use.Val));
+        if (!UseSlot) {
+          FixedUses.insert(Use.Val);
+          NumRuntimePairs++;
+          continue;
+        }
+        UseSlot->Loc = getSrcLocation(cast<Instruction>(Use.Val));
+        It = UseIdxs.try_emplace(Use.Val, UseSlots.size()).first;
+        UseSlots.push_back(*UseSlot);
+        UseDefs.emplace_back();
+      }
+      DefUseIdxs.push_back(It->second);
+    }
+
+    // Defs without a rewritable use are still rewritten, so that they do not
+    // share a tag with a def that has one
+    if (DefUseIdxs.empty()) {
+      UnchainedDefSlots.push_back(*DefSlot);
+      continue;
+    }
+
+    for (auto UseIdx : DefUseIdxs) {
+      UseDefs[UseIdx].push_back(DefSlots.size());
+    }
+    DefSlots.push_back(*DefSlot);
+  }
+
+  const auto NumDefs = DefSlots.size() + UnchainedDefSlots.size();
+  if (NumDefs > kFuzzallocTagMax - kFuzzallocTagMin + 1) {
+    error_stream() << "Too many def sites (" << NumDefs
+                   << ") for the tag space\n";
+    ::exit(1);
+  }
+
+  success_stream() << "Collected " << NumDefs << " def tags ("
+                   << UnchainedDefSlots.size()
+                   << " without rewritable uses) and " << UseSlots.size()
+                   << " use tags\n";
+  if (NumFixedDefs || !FixedUses.empty()) {
+    warning_stream() << NumFixedDefs << " def tags and " << FixedUses.size()
+                     << " use tags are computed at runtime and will not be "
+                        "rewritten\n";
+  }
+
+  //
+  // Assign tags
+  //
+  // Def tags are assigned consecutively (and are therefore unique), with defs
+  // without rewritable uses after the defs with. Use tags are then assigned
+  // greedily, most-constrained first: each use takes the smallest tag whose
+  // hash (def tag XOR use tag) with every one of its defs hits a free map
+  // index. A use that cannot be assigned keeps its original tag, and its
+  // chains' indices are reserved so that later uses avoid them. Map index 0 is
+  // reserved for accesses to untagged memory
+  //
+
+  for (auto &DefEnum : enumerate(DefSlots)) {
+    DefEnum.value().Tag = kFuzzallocTagMin + DefEnum.index();
+  }
+  for (auto &DefEnum : enumerate(UnchainedDefSlots)) {
+    DefEnum.value().Tag = kFuzzallocTagMin + DefSlots.size() + DefEnum.index();
+  }
+
+  SmallVector<unsigned, 0> UseOrder(UseSlots.size());
+  std::iota(UseOrder.begin(), UseOrder.end(), 0);
+  llvm::stable_sort(UseOrder, [&](unsigned A, unsigned B) {
+    return UseDefs[A].size() > UseDefs[B].size();
+  });
+
+  BitVector UsedIdxs(kFuzzallocTagMax + 1);
+  UsedIdxs.set(0);
+  size_t NumAssignedUses = 0;
+
+  status_stream() << "Assigning use tags...\n";
+  for (auto UseIdx : UseOrder) {
+    const auto &Defs = UseDefs[UseIdx];
+    auto &UseSlot = UseSlots[UseIdx];
+
+    UseSlot.Tag = UseSlot.getTag();
+    for (unsigned T = 0; T <= kFuzzallocTagMax; ++T) {
+      const auto Free = all_of(Defs, [&](unsigned DefIdx) {
+        return !UsedIdxs.test(DefSlots[DefIdx].Tag ^ T);
+      });
+      if (Free) {
+        UseSlot.Tag = T;
+        NumAssignedUses++;
+        break;
+      }
+    }
+
+    for (auto DefIdx : Defs) {
+      UsedIdxs.set(DefSlots[DefIdx].Tag ^ UseSlot.Tag);
+    }
+  }
+
+  // Record each site's new tag (keyed by its original tag) before rewriting,
+  // so that the tag map can be updated
+  RewrittenTags RewrittenDefs, RewrittenUses;
+  for (const auto &Slots : {&DefSlots, &UnchainedDefSlots}) {
+    for (const auto &Slot : *Slots) {
+      RewrittenDefs[getSiteKey(Slot.getTag(), Slot.Loc)].push_back(Slot.Tag);
+    }
+  }
+  for (const auto &Slot : UseSlots) {
+    RewrittenUses[getSiteKey(Slot.getTag(), Slot.Loc)].push_back(Slot.Tag);
+  }
+
+  auto *TagTy = Type::getIntNTy(Ctx, kNumTagBits);
+  for (const auto &Slots : {&DefSlots, &UnchainedDefSlots, &UseSlots}) {
+    for (const auto &Slot : *Slots) {
+      Slot.rewrite(TagTy);
+    }
+  }
+
+  //
+  // Check the final layout. Chains whose def and use tags are both constant
+  // collide if they share a map index (or hit index 0)
+  //
+
+  SmallVector<unsigned, 0> IdxCounts(kFuzzallocTagMax + 1);
+  for (size_t UseIdx = 0; UseIdx < UseSlots.size(); ++UseIdx) {
+    for (auto DefIdx : UseDefs[UseIdx]) {
+      IdxCounts[DefSlots[DefIdx].Tag ^ UseSlots[UseIdx].Tag]++;
+    }
+  }
+
+  size_t NumPairs = 0, NumCollisions = 0;
+  unsigned MaxIdx = 0;
+  for (unsigned Idx = 0; Idx < IdxCounts.size(); ++Idx) {
+    if (IdxCounts[Idx] == 0) {
+      continue;
+    }
+    NumPairs += IdxCounts[Idx];
+    if (Idx == 0 || IdxCounts[Idx] > 1) {
+      NumCollisions += IdxCounts[Idx];
+    }
+    MaxIdx = Idx;
+  }
+
+  success_stream() << "Assigned " << NumAssignedUses << '/' << UseSlots.size()
+                   << " use tags (" << NumPairs - NumCollisions << '/'
+                   << NumPairs << " collision-free def-use chains)\n";
+  if (NumRuntimePairs > 0) {
+    warning_stream() << NumRuntimePairs
+                     << " def-use chains have a def or use tag computed at "
+                        "runtime, and may collide with any chain\n";
+  }
+  success_stream() << "Required map size: " << PowerOf2Ceil(MaxIdx + 1) << '\n';
+
+  if (NumCollisions > 0) {
+    error_stream() << NumCollisions << " def-use chains collide ("
+                   << UseSlots.size() - NumAssignedUses
+                   << " use tags could not be assigned without collisions "
+                      "and keep their original tag)\n";
+    if (!AllowCollisions) {
+      error_stream() << "Not writing " << OutBC
+                     << " (pass -allow-collisions to write it anyway)\n";
+      ::exit(1);
+    }
+  }
+
+  // Save output bitcode
+  if (verifyModule(*Mod, &errs())) {
+    error_stream() << "Rewritten module is broken\n";
+    ::exit(1);
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(OutBC, EC, sys::fs::OF_None);
+  if (EC) {
+    error_stream() << "Unable to open " << OutBC << '\n';
+    ::exit(1);
+  }
+
+  status_stream() << "Writing to " << OutBC << "...\n";
+  WriteBitcodeToFile(*Mod, OS);
+  OS.flush();
+  OS.close();
+
+  // Update the tag map. Sites are matched to their records by their original
+  // tag and source location
+  if (!InTagMap.empty()) {
+    status_stream() << "Writing tag map to " << OutTagMap << "...\n";
+    auto NumUpdatedOrErr =
+        writeTagMap(InTagMap, OutTagMap, RewrittenDefs, RewrittenUses);
+    if (auto E = NumUpdatedOrErr.takeError()) {
+      error_stream() << "Failed to update tag map `" << InTagMap
+                     << "`: " << E << '\n';
+      ::exit(1);
+    }
+    success_stream() << "Updated " << *NumUpdatedOrErr
+                     << " tag map records\n";
+
+    if (!RewrittenDefs.empty() || !RewrittenUses.empty()) {
+      warning_stream() << RewrittenDefs.size() << " def and "
+                       << RewrittenUses.size()
+                       << " use sites were rewritten but have no tag map "
+                          "record, so cannot be resolved by dua-showmap\n";
+    }
+  }
+
+  // Cleanup
+  llvm_shutdown();
+
+  return 0;
+}
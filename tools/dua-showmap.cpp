@@ -0,0 +1,556 @@
+//===-- dua-showmap.cpp - Show def-use pairs in the AFL map -----*- C++ -*-===//
+///
+/// \file
+/// Run testcases through an AFL-instrumented binary (via the AFL fork server)
+/// and map the non-zero coverage map entries back to candidate def-use pairs,
+/// using the tag map written by the instrumentation passes (see
+/// `-fuzzalloc-tag-map`).
+///
+//===----------------------------------------------------------------------===//
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "absl/container/flat_hash_map.h"
+
+#include "fuzzalloc/Streams.h"
+#include "fuzzalloc/fuzzalloc.h"
+
+// AFL++ headers
+#include "config.h"
+#include "types.h"
+
+using namespace llvm;
+
+namespace {
+//
+// Command-line options
+//
+
+static cl::OptionCategory DUAShowmap("DUA showmap options");
+
+static cl::opt<std::string>
+    InPath("i", cl::desc("Testcase (or queue directory of testcases)"),
+           cl::value_desc("path"), cl::Required, cl::cat(DUAShowmap));
+static cl::opt<std::string>
+    TagMapPath("m", cl::desc("Tag map (written by `-fuzzalloc-tag-map`)"),
+               cl::value_desc("path"), cl::Required, cl::cat(DUAShowmap));
+static cl::opt<std::string> OutJSON("o", cl::desc("Output JSON"),
+                                    cl::value_desc("path"), cl::Required,
+                                    cl::cat(DUAShowmap));
+static cl::opt<unsigned> Timeout("t", cl::desc("Timeout (ms)"),
+                                 cl::value_desc("ms"), cl::init(1000),
+                                 cl::cat(DUAShowmap));
+static cl::opt<std::string> Target(cl::Positional, cl::desc("<target>"),
+                                   cl::Required, cl::cat(DUAShowmap));
+static cl::list<std::string> TargetArgs(cl::ConsumeAfter, cl::desc("[...]"),
+                                        cl::cat(DUAShowmap));
+
+//
+// Global variables
+//
+
+static const ExitOnError ExitOnErr("dua-showmap: ");
+
+//
+// Helper functions
+//
+
+static bool readAll(int Fd, void *Buf, size_t Len) {
+  auto *P = static_cast<char *>(Buf);
+  while (Len > 0) {
+    const auto N = read(Fd, P, Len);
+    if (N <= 0) {
+      return false;
+    }
+    P += N;
+    Len -= N;
+  }
+  return true;
+}
+
+static bool writeAll(int Fd, const void *Buf, size_t Len) {
+  const auto *P = static_cast<const char *>(Buf);
+  while (Len > 0) {
+    const auto N = write(Fd, P, Len);
+    if (N <= 0) {
+      return false;
+    }
+    P += N;
+    Len -= N;
+  }
+  return true;
+}
+
+static Error errnoError() {
+  return errorCodeToError(std::error_code(errno, std::generic_category()));
+}
+
+//
+// Classes
+//
+
+/// A tagged def or use site
+struct TagSite {
+  std::string Var; ///< Variable name (defs only)
+  json::Value Loc; ///< Source location, as `[file, func, line, col]`
+};
+
+/// Def and use site tags recorded by the instrumentation passes. The tag map
+/// is a sequence of JSON records (one per line), either
+/// `{"def": tag, "var": name, "loc": loc[, "context": depth]}` or
+/// `{"use": tag, "capture": capture, "loc": loc}`.
+///
+/// Only sites whose tags hash directly to the coverage map are resolvable:
+/// `use` capture (where the map index is `def tag ^ use tag`) and defs whose
+/// tag is not mixed with an allocation context at runtime. Other sites are
+/// counted, but not resolved
+class TagMap {
+public:
+  using SiteMap = absl::flat_hash_map<tag_t, SmallVector<TagSite, 1>>;
+
+  /// Load a tag map
+  static Expected<TagMap> load(const StringRef &);
+
+  /// Candidate def-use pairs that hash to the given map index, as
+  /// `[[var, def loc], use loc]`
+  json::Array resolve(uint32_t) const;
+
+  size_t numDefs() const { return NumDefs; }
+  size_t numUses() const { return NumUses; }
+
+  /// Heap defs whose tags are mixed with an allocation context
+  size_t numContextDefs() const { return NumContextDefs; }
+
+  /// Uses that also hash the accessed offset (and value)
+  size_t numCaptureUses() const { return NumCaptureUses; }
+
+private:
+  TagMap() = default;
+
+  SiteMap Defs;
+  SiteMap Uses;
+  size_t NumDefs = 0;
+  size_t NumUses = 0;
+  size_t NumContextDefs = 0;
+  size_t NumCaptureUses = 0;
+};
+
+Expected<TagMap> TagMap::load(const StringRef &Path) {
+  auto BufOrErr = MemoryBuffer::getFile(Path, /*IsText=*/true);
+  if (const auto EC = BufOrErr.getError()) {
+    return errorCodeToError(EC);
+  }
+
+  TagMap Map;
+
+  // Modules may be recompiled, appending duplicate records
+  StringSet<> Seen;
+  SmallVector<StringRef, 0> Lines;
+  (*BufOrErr)->getBuffer().split(Lines, '\n', /*MaxSplit=*/-1,
+                                 /*KeepEmpty=*/false);
+
+  for (size_t I = 0; I < Lines.size(); ++I) {
+    if (!Seen.insert(Lines[I]).second) {
+      continue;
+    }
+
+    const auto MalformedErr = [&]() {
+      return createStringError(inconvertibleErrorCode(),
+                               "%s:%zu: malformed tag map record",
+                               Path.str().c_str(), I + 1);
+    };
+
+    auto RecordOrErr = json::parse(Lines[I]);
+    if (!RecordOrErr) {
+      consumeError(RecordOrErr.takeError());
+      return MalformedErr();
+    }
+
+    const auto *Record = RecordOrErr->getAsObject();
+    const auto *Loc = Record ? Record->getArray("loc") : nullptr;
+    if (!Loc) {
+      return MalformedErr();
+    }
+
+    if (const auto Tag = Record->getInteger("def")) {
+      Map.NumDefs++;
+      if (Record->getInteger("context").getValueOr(0) > 0) {
+        Map.NumContextDefs++;
+        continue;
+      }
+      const auto Var = Record->getString("var");
+      Map.Defs[*Tag].push_back({Var ? Var->str() : "", json::Array(*Loc)});
+    } else if (const auto Tag = Record->getInteger("use")) {
+      Map.NumUses++;
+      if (Record->getString("capture").getValueOr("use") != "use") {
+        Map.NumCaptureUses++;
+        continue;
+      }
+      Map.Uses[*Tag].push_back({"", json::Array(*Loc)});
+    } else {
+      return MalformedErr();
+    }
+  }
+
+  return std::move(Map);
+}
+
+json::Array TagMap::resolve(uint32_t Idx) const {
+  json::Array Pairs;
+
+  const auto AddPairs = [&](const SmallVectorImpl<TagSite> &DefSites,
+                            const SmallVectorImpl<TagSite> &UseSites) {
+    for (const auto &Def : DefSites) {
+      for (const auto &Use : UseSites) {
+        Pairs.push_back(json::Array{json::Array{Def.Var, Def.Loc}, Use.Loc});
+      }
+    }
+  };
+
+  // The map index is `def tag ^ use tag`, so iterate over whichever of the
+  // defs or uses has fewer distinct tags. Index zero is either a use of an
+  // untagged def (which has no candidates) or a def and use with equal tags
+  if (Defs.size() <= Uses.size()) {
+    for (const auto &[DefTag, DefSites] : Defs) {
+      const auto It = Uses.find(static_cast<tag_t>(DefTag ^ Idx));
+      if (It != Uses.end() && (DefTag ^ It->first) == Idx) {
+        AddPairs(DefSites, It->second);
+      }
+    }
+  } else {
+    for (const auto &[UseTag, UseSites] : Uses) {
+      const auto It = Defs.find(static_cast<tag_t>(UseTag ^ Idx));
+      if (It != Defs.end() && (UseTag ^ It->first) == Idx) {
+        AddPairs(It->second, UseSites);
+      }
+    }
+  }
+
+  return Pairs;
+}
+
+/// A target running the AFL fork server, with its coverage map in shared
+/// memory
+class AFLForkServer {
+public:
+  AFLForkServer(const AFLForkServer &) = delete;
+
+  ~AFLForkServer() {
+    // Closing the control pipe stops the server
+    close(CtlFd);
+    close(StatusFd);
+    kill(Pid, SIGKILL);
+    waitpid(Pid, nullptr, 0);
+    shmdt(Map);
+    shmctl(ShmId, IPC_RMID, nullptr);
+  }
+
+  /// Start the target and wait for the fork server handshake
+  static Expected<std::unique_ptr<AFLForkServer>>
+  start(const ArrayRef<std::string> &Args) {
+    const auto ShmId =
+        shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+    if (ShmId < 0) {
+      return errnoError();
+    }
+    auto *Map = static_cast<uint8_t *>(shmat(ShmId, nullptr, 0));
+    if (Map == reinterpret_cast<uint8_t *>(-1)) {
+      shmctl(ShmId, IPC_RMID, nullptr);
+      return errnoError();
+    }
+
+    // Build everything before forking
+    SmallVector<char *, 16> Argv;
+    for (const auto &A : Args) {
+      Argv.push_back(const_cast<char *>(A.c_str()));
+    }
+    Argv.push_back(nullptr);
+
+    const auto ShmEnv = (Twine(SHM_ENV_VAR) + "=" + Twine(ShmId)).str();
+    SmallVector<char *, 64> Envp;
+    for (auto **E = environ; *E; ++E) {
+      if (!StringRef(*E).startswith(SHM_ENV_VAR "=")) {
+        Envp.push_back(*E);
+      }
+    }
+    Envp.push_back(const_cast<char *>(ShmEnv.c_str()));
+    Envp.push_back(nullptr);
+
+    int CtlPipe[2], StatusPipe[2];
+    if (pipe2(CtlPipe, O_CLOEXEC) != 0) {
+      shmdt(Map);
+      shmctl(ShmId, IPC_RMID, nullptr);
+      return errnoError();
+    }
+    if (pipe2(StatusPipe, O_CLOEXEC) != 0) {
+      close(CtlPipe[0]);
+      close(CtlPipe[1]);
+      shmdt(Map);
+      shmctl(ShmId, IPC_RMID, nullptr);
+      return errnoError();
+    }
+
+    const auto Pid = fork();
+    if (Pid < 0) {
+      auto E = errnoError();
+      close(CtlPipe[0]);
+      close(CtlPipe[1]);
+      close(StatusPipe[0]);
+      close(StatusPipe[1]);
+      shmdt(Map);
+      shmctl(ShmId, IPC_RMID, nullptr);
+      return std::move(E);
+    }
+
+    // Run target. Ignore output
+    if (Pid == 0) {
+      dup2(CtlPipe[0], FORKSRV_FD);
+      dup2(StatusPipe[1], FORKSRV_FD + 1);
+
+      const auto DevNull = open("/dev/null", O_RDWR);
+      dup2(DevNull, STDOUT_FILENO);
+      dup2(DevNull, STDERR_FILENO);
+
+      execve(Argv[0], Argv.data(), Envp.data());
+      _exit(127);
+    }
+
+    close(CtlPipe[0]);
+    close(StatusPipe[1]);
+    std::unique_ptr<AFLForkServer> Srv(
+        new AFLForkServer(Pid, CtlPipe[1], StatusPipe[0], ShmId, Map));
+
+    uint32_t Hello;
+    if (!readAll(Srv->StatusFd, &Hello, sizeof(Hello))) {
+      return createStringError(inconvertibleErrorCode(),
+                               "%s did not start an AFL fork server (is it "
+                               "built with AFL instrumentation?)",
+                               Args.front().c_str());
+    }
+
+    // Decline any fork server options that require a reply (e.g., an
+    // autodictionary or shared memory testcases)
+    if ((Hello & FS_OPT_ENABLED) == FS_OPT_ENABLED) {
+      if ((Hello & FS_OPT_MAPSIZE) == FS_OPT_MAPSIZE &&
+          FS_OPT_GET_MAPSIZE(Hello) > MAP_SIZE) {
+        return createStringError(inconvertibleErrorCode(),
+                                 "%s requires a %u byte coverage map",
+                                 Args.front().c_str(),
+                                 FS_OPT_GET_MAPSIZE(Hello));
+      }
+      if (Hello & (FS_OPT_AUTODICT | FS_OPT_SHDMEM_FUZZ)) {
+        const uint32_t Reply = 0;
+        if (!writeAll(Srv->CtlFd, &Reply, sizeof(Reply))) {
+          return errnoError();
+        }
+      }
+    }
+
+    return std::move(Srv);
+  }
+
+  /// Run the target once (killing it after `Timeout` ms). Returns `false` if
+  /// the fork server has died
+  bool run(unsigned Timeout) {
+    memset(Map, 0, MAP_SIZE);
+
+    int32_t ChildPid, Status;
+    const uint32_t WasKilled = PrevTimedOut;
+    if (!writeAll(CtlFd, &WasKilled, sizeof(WasKilled)) ||
+        !readAll(StatusFd, &ChildPid, sizeof(ChildPid)) || ChildPid <= 0) {
+      return false;
+    }
+
+    struct pollfd PFD = {StatusFd, POLLIN, 0};
+    PrevTimedOut = poll(&PFD, 1, Timeout) == 0;
+    if (PrevTimedOut) {
+      kill(ChildPid, SIGKILL);
+    }
+
+    return readAll(StatusFd, &Status, sizeof(Status));
+  }
+
+  /// Non-zero coverage map entries (from the last run), as (index, count)
+  std::vector<std::pair<uint32_t, uint8_t>> entries() const {
+    std::vector<std::pair<uint32_t, uint8_t>> Entries;
+    for (uint32_t I = 0; I < MAP_SIZE; ++I) {
+      if (Map[I]) {
+        Entries.emplace_back(I, Map[I]);
+      }
+    }
+    return Entries;
+  }
+
+  bool timedOut() const { return PrevTimedOut; }
+
+private:
+  AFLForkServer(pid_t Pid, int CtlFd, int StatusFd, int ShmId, uint8_t *Map)
+      : Pid(Pid), CtlFd(CtlFd), StatusFd(StatusFd), ShmId(ShmId), Map(Map) {}
+
+  const pid_t Pid;
+  const int CtlFd;
+  const int StatusFd;
+  const int ShmId;
+  uint8_t *const Map;
+  bool PrevTimedOut = false;
+};
+} // anonymous namespace
+
+//
+// The main function
+//
+
+int main(int argc, char *argv[]) {
+  // Parse command-line arguments
+  cl::HideUnrelatedOptions(DUAShowmap);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "Show the def-use pairs covered by testcases run through an "
+      "AFL-instrumented binary\n");
+
+  // Collect testcases
+  std::vector<std::string> Testcases;
+  if (sys::fs::is_directory(InPath)) {
+    std::error_code EC;
+    for (sys::fs::directory_iterator It(InPath, EC), End; It != End && !EC;
+         It.increment(EC)) {
+      if (sys::fs::is_regular_file(It->path())) {
+        Testcases.push_back(It->path());
+      }
+    }
+    if (EC) {
+      error_stream() << "Unable to read " << InPath << ": " << EC.message()
+                     << '\n';
+      return 1;
+    }
+    llvm::sort(Testcases);
+  } else if (sys::fs::is_regular_file(InPath)) {
+    Testcases.push_back(InPath);
+  } else {
+    error_stream() << InPath << " is an invalid testcase or directory\n";
+    return 1;
+  }
+
+  // Load tag map
+  status_stream() << "Loading tag map " << TagMapPath << "...\n";
+  const auto Tags = ExitOnErr(TagMap::load(TagMapPath));
+  success_stream() << "Loaded " << Tags.numDefs() << " def tags and "
+                   << Tags.numUses() << " use tags\n";
+  if (Tags.numContextDefs() > 0) {
+    warning_stream() << Tags.numContextDefs()
+                     << " heap def tags are mixed with an allocation context "
+                        "at runtime. Pairs with these defs are not resolved\n";
+  }
+  if (Tags.numCaptureUses() > 0) {
+    warning_stream() << Tags.numCaptureUses()
+                     << " use tags are hashed with the accessed offset (or "
+                        "value) at runtime. Pairs with these uses are not "
+                        "resolved\n";
+  }
+
+  // Construct target command line. The input file replaces `@@`
+  SmallString<32> InputPath;
+  if (const auto EC =
+          sys::fs::createTemporaryFile("showmap", "input", InputPath)) {
+    error_stream() << "Unable to create input file: " << EC.message() << '\n';
+    return 1;
+  }
+
+  std::vector<std::string> Args{Target};
+  Args.insert(Args.end(), TargetArgs.begin(), TargetArgs.end());
+  const auto AtAtIt = std::find(Args.begin() + 1, Args.end(), "@@");
+  if (AtAtIt == Args.end()) {
+    Args.push_back(InputPath.str().str());
+  } else {
+    *AtAtIt = InputPath.str().str();
+  }
+
+  //
+  // Run testcases
+  //
+
+  status_stream() << "Running " << Testcases.size() << " testcases through `"
+                  << Target << "`...\n";
+
+  json::Array J;
+  size_t NumEntries = 0, NumResolved = 0;
+  std::unique_ptr<AFLForkServer> Srv;
+
+  for (const auto &Testcase : Testcases) {
+    // (Re)start the fork server
+    if (!Srv) {
+      auto SrvOrErr = AFLForkServer::start(Args);
+      if (auto E = SrvOrErr.takeError()) {
+        sys::fs::remove(InputPath);
+        ExitOnErr(std::move(E));
+      }
+      Srv = std::move(*SrvOrErr);
+    }
+
+    if (const auto EC = sys::fs::copy_file(Testcase, InputPath)) {
+      warning_stream() << '`' << Testcase << "`: " << EC.message()
+                       << ". Skipping...\n";
+      continue;
+    }
+    if (!Srv->run(Timeout)) {
+      warning_stream() << '`' << Testcase
+                       << "`: fork server died. Skipping...\n";
+      Srv.reset();
+      continue;
+    }
+    if (Srv->timedOut()) {
+      warning_stream() << '`' << Testcase << "`: timed out\n";
+    }
+
+    json::Array JEntries;
+    for (const auto &[Idx, Count] : Srv->entries()) {
+      auto Pairs = Tags.resolve(Idx);
+      NumEntries++;
+      NumResolved += !Pairs.empty();
+      JEntries.push_back(json::Object{
+          {"index", Idx}, {"count", Count}, {"pairs", std::move(Pairs)}});
+    }
+
+    J.push_back(json::Object{{"testcase", sys::path::filename(Testcase).str()},
+                             {"entries", std::move(JEntries)}});
+  }
+
+  Srv.reset();
+  sys::fs::remove(InputPath);
+  success_stream() << "Resolved " << NumResolved << " of " << NumEntries
+                   << " non-zero map entries\n";
+
+  // Write to JSON
+  status_stream() << "Writing def-use pairs to " << OutJSON << "...\n";
+
+  std::error_code EC;
+  raw_fd_ostream OS(OutJSON, EC, sys::fs::OF_Text);
+  if (EC) {
+    error_stream() << "Unable to open " << OutJSON << '\n';
+    return 1;
+  }
+  OS << json::Value(std::move(J));
+  OS.flush();
+
+  return 0;
+}
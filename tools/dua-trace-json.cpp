@@ -0,0 +1,56 @@
+//===-- dua-trace-json.cpp - Convert def-use traces to JSON -----*- C++ -*-===//
+///
+/// \file
+/// Convert a (binary) def-use trace generated by the tracer runtime to JSON.
+///
+//===----------------------------------------------------------------------===//
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "fuzzalloc/Runtime/Trace.h"
+#include "fuzzalloc/Streams.h"
+
+using namespace llvm;
+
+namespace {
+//
+// Command-line options
+//
+
+static cl::OptionCategory Cat("Def-use trace conversion");
+static cl::opt<std::string> TraceFilename(cl::Positional,
+                                          cl::desc("<trace file>"),
+                                          cl::value_desc("path"),
+                                          cl::Required, cl::cat(Cat));
+static cl::opt<std::string> OutJSON("o", cl::desc("Output JSON"),
+                                    cl::value_desc("path"), cl::init("-"),
+                                    cl::cat(Cat));
+
+//
+// Global variables
+//
+
+static const ExitOnError ExitOnErr("dua-trace-json: ");
+} // anonymous namespace
+
+int main(int argc, char *argv[]) {
+  cl::HideUnrelatedOptions(Cat);
+  cl::ParseCommandLineOptions(argc, argv, "Convert def-use traces to JSON\n");
+
+  const auto Trace = ExitOnErr(DUATrace::load(TraceFilename));
+
+  std::error_code EC;
+  raw_fd_ostream OS(OutJSON, EC, sys::fs::OF_Text);
+  if (EC) {
+    error_stream() << "Unable to open " << OutJSON << '\n';
+    return 1;
+  }
+
+  OS << Trace.toJSON();
+  OS.flush();
+
+  return 0;
+}
@@ -12,13 +12,12 @@
 
 #include <llvm/ADT/STLExtras.h>
 #include <llvm/ADT/SmallVector.h>
-#include <llvm/ProfileData/Coverage/CoverageMappingReader.h>
-#include <llvm/ProfileData/InstrProfReader.h>
-#include <llvm/ProfileData/InstrProfWriter.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Error.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/NativeFormatting.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/Program.h>
@@ -29,6 +28,7 @@
 #include "fuzzalloc/Streams.h"
 
 #include "CovJSONCommon.h"
+#include "LLVMCovCommon.h"
 
 using namespace llvm;
 
@@ -39,15 +39,53 @@ namespace {
 
 static cl::OptionCategory LLVMCovJSON("LLVM coverage options");
 
+static cl::list<std::string> QueueDirs(
+    "i",
+    cl::desc("Queue directory (containing fuzzer test cases). Multiple queues "
+             "(e.g., from different trials) are replayed in batch"),
+    cl::value_desc("path"), cl::OneOrMore, cl::cat(LLVMCovJSON));
 static cl::opt<std::string>
-    QueueDir("i", cl::desc("Queue directory (containing fuzzer test cases)"),
-             cl::value_desc("path"), cl::Required, cl::cat(LLVMCovJSON));
-static cl::opt<std::string> OutJSON("o", cl::desc("Output JSON"),
-                                    cl::value_desc("path"), cl::Required,
-                                    cl::cat(LLVMCovJSON));
+    OutJSON("o",
+            cl::desc("Output JSON (or output directory, if replaying multiple "
+                     "queues)"),
+            cl::value_desc("path"), cl::Required, cl::cat(LLVMCovJSON));
 static cl::opt<unsigned> NumThreads("j", cl::desc("Number of threads"),
                                     cl::value_desc("N"), cl::init(0),
                                     cl::cat(LLVMCovJSON));
+static cl::opt<bool>
+    UseForkServer("forkserver",
+                  cl::desc("Replay testcases through the coverage runtime's "
+                           "fork server"),
+                  cl::cat(LLVMCovJSON));
+static cl::opt<bool>
+    UseShm("shm",
+           cl::desc("Replay testcases through the coverage runtime's fork "
+                    "server, collecting coverage through shared memory"),
+           cl::cat(LLVMCovJSON));
+static cl::opt<std::string>
+    CacheDir("cache",
+             cl::desc("Coverage cache directory (only testcases not already "
+                      "in the cache are replayed)"),
+             cl::value_desc("path"), cl::cat(LLVMCovJSON));
+static cl::opt<TimestampSource> Timestamps(
+    "timestamps",
+    cl::desc("Accumulate coverage in time buckets, using testcase timestamps "
+             "from:"),
+    cl::values(clEnumValN(TimestampSource::AFL, "afl",
+                          "AFL++ `time:` field in the testcase name"),
+               clEnumValN(TimestampSource::MTime, "mtime",
+                          "Testcase modification time"),
+               clEnumValN(TimestampSource::CSV, "csv",
+                          "CSV file given by -timestamp-csv")),
+    cl::init(TimestampSource::None), cl::cat(LLVMCovJSON));
+static cl::opt<std::string>
+    TimestampCSV("timestamp-csv",
+                 cl::desc("CSV of (testcase, timestamp in seconds) rows"),
+                 cl::value_desc("path"), cl::cat(LLVMCovJSON));
+static cl::opt<unsigned> BinSize("bin",
+                                 cl::desc("Time bucket size (in seconds)"),
+                                 cl::value_desc("seconds"), cl::init(60),
+                                 cl::cat(LLVMCovJSON));
 static cl::opt<std::string> Target(cl::Positional, cl::desc("<target>"),
                                    cl::Required, cl::cat(LLVMCovJSON));
 static cl::list<std::string> TargetArgs(cl::ConsumeAfter, cl::desc("[...]"),
@@ -63,135 +101,195 @@ static const ExitOnError ExitOnErr("llvm-cov-json: ");
 // Coverage functions
 //
 
-/// Accumulate coverage over all testcases
-static Expected<TestcaseCoverages> accumulateCoverage(
-    const StringRef &CovDir, ///< Directory containing raw coverage files
-    const StringRef &Target  ///< Clang source-code-instrumented target program
+/// Accumulate coverage over time buckets. Raw profiles in the same bucket are
+/// read in parallel, and their counters added (in no particular order) before
+/// the changed functions are recounted once per bucket
+static Expected<TimeBinCoverages> accumulateBinnedCoverage(
+    RawCoverages &Covs,      ///< Raw coverage
+    const TimeBins &Bins,    ///< Raw coverage in each time bucket
+    uint64_t BinSize,        ///< Time bucket size (in seconds)
+    const StringRef &Target, ///< Clang source-code-instrumented target program
+    unsigned NumThreads      ///< Number of parser threads
 ) {
-  // Get the number of coverage files
-  auto NumCovFilesOrErr = getNumFiles(CovDir);
-  if (auto E = NumCovFilesOrErr.takeError()) {
-    return std::move(E);
-  }
-  const auto NumCovFiles = *NumCovFilesOrErr;
+  using ProfileCounts = CoverageAccumulator::ProfileCounts;
 
-  // Get the actual coverage files
-  auto TestcasesOrErr = getTestcases(CovDir);
-  if (auto E = TestcasesOrErr.takeError()) {
-    return std::move(E);
-  }
+  const auto NumBins = Bins.size();
 
-  // Load the target (for profile instrumentation)
-  auto CovMappingBufOrErr = MemoryBuffer::getFile(Target);
-  if (const auto &EC = CovMappingBufOrErr.getError()) {
-    return errorCodeToError(EC);
+  // Load the target's coverage mapping
+  auto AccumOrErr = CoverageAccumulator::create(Target);
+  if (auto E = AccumOrErr.takeError()) {
+    return std::move(E);
   }
+  auto &Accum = *AccumOrErr;
 
-  TestcaseCoverages TestcaseCovs;
-  TestcaseCovs.reserve(NumCovFiles);
-
-  // Initialize a profile writer (for indexing the raw coverage profiles)
-  SmallVector<std::unique_ptr<coverage::CoverageMappingReader>, 4> CovReaders;
-  SmallVector<std::unique_ptr<MemoryBuffer>, 4> Buffers;
-  std::unique_ptr<coverage::CoverageMapping> CovMap;
-
-  InstrProfWriter ProfWriter(/*Sparse=*/true);
-
-  //
-  // Parse llvm-cov coverage
-  //
+  TimeBinCoverages BinCovs;
+  BinCovs.reserve(NumBins);
 
-  for (const auto &CovFileEnum : enumerate(*TestcasesOrErr)) {
-    const auto &CovFile = CovFileEnum.value();
-
-    // Create instrumentation profile reader
-    auto ProfReaderOrErr = InstrProfReader::create(CovFile.c_str());
-    if (auto E = ProfReaderOrErr.takeError()) {
-      warning_stream() << '`' << CovFile << "`: " << E << ". Skipping...\n";
-      continue;
-    }
-    const auto &ProfReader = std::move(*ProfReaderOrErr);
+  ThreadPool Pool(hardware_concurrency(NumThreads));
 
-    //
-    // Accumulate and index the raw coverage profile
-    //
+  for (size_t Bin = 0; Bin < NumBins; ++Bin) {
+    const auto &BinCovIdxs = Bins[Bin];
+    std::vector<Optional<Expected<ProfileCounts>>> Parsed(BinCovIdxs.size());
 
-    for (auto &Func : *ProfReader) {
-      ProfWriter.addRecord(std::move(Func), /*Weight=*/1, nullptr);
+    for (size_t I = 0; I < BinCovIdxs.size(); ++I) {
+      Pool.async([&, I]() {
+        auto &RawCov = Covs[BinCovIdxs[I]];
+        auto BufOrErr = RawCov.load();
+        if (auto E = BufOrErr.takeError()) {
+          Parsed[I] = std::move(E);
+          return;
+        }
+        Parsed[I] = Accum.readProfile(*BufOrErr);
+        RawCov.Buf.reset();
+      });
     }
+    Pool.wait();
 
-    if (ProfReader->hasError()) {
-      if (auto E = ProfReader->getError()) {
-        return std::move(E);
+    for (size_t I = 0; I < BinCovIdxs.size(); ++I) {
+      auto &CountsOrErr = *Parsed[I];
+      if (auto E = CountsOrErr.takeError()) {
+        warning_stream() << '`' << Covs[BinCovIdxs[I]].Path << "`: " << E
+                         << ". Skipping...\n";
+        continue;
       }
+      Accum.add(*CountsOrErr);
     }
+    Accum.flush();
+
+    const auto Count = Accum.count();
+    BinCovs.emplace_back((Bin + 1) * BinSize, Count);
 
-    auto IndexedReaderOrErr =
-        IndexedInstrProfReader::create(ProfWriter.writeBuffer());
-    if (auto E = IndexedReaderOrErr.takeError()) {
-      return std::move(E);
+    if (Bin % ((NumBins + (10 - 1)) / 10) == 0) {
+      status_stream() << "  ";
+      write_double(outs(), static_cast<float>(Bin) / NumBins,
+                   FloatStyle::Percent);
+      outs() << " time buckets accumulated (count = " << Count << ")\r";
     }
+  }
+  outs() << '\n';
 
-    //
-    // Initialize coverage readers
-    //
+  return BinCovs;
+}
 
-    Buffers.clear();
-    auto CovReadersOrErr = coverage::BinaryCoverageReader::create(
-        CovMappingBufOrErr.get()->getMemBufferRef(), "", Buffers);
-    if (auto E = CovReadersOrErr.takeError()) {
-      return std::move(E);
-    }
+/// Replay several queues (trials) in batch, writing each trial's coverage to
+/// the output directory. Each unique testcase is only replayed (and its raw
+/// profile read) once
+static Error replayBatch(const ReplayOptions &Opts) {
+  using ProfileCounts = CoverageAccumulator::ProfileCounts;
 
-    CovReaders.clear();
-    for (auto &Reader : *CovReadersOrErr) {
-      CovReaders.push_back(std::move(Reader));
-    }
+  if (const auto EC = sys::fs::create_directories(OutJSON)) {
+    return errorCodeToError(EC);
+  }
+
+  // Load the target's coverage mapping
+  auto AccumOrErr = CoverageAccumulator::create(Opts.Target);
+  if (auto E = AccumOrErr.takeError()) {
+    return E;
+  }
+  auto &Accum = *AccumOrErr;
 
-    //
-    // Load coverage mapping
-    //
+  // Collect raw coverage
+  std::vector<Trial> Trials;
+  SmallString<16> CovDir;
+  auto CovsOrErr = replayTrials(Opts, QueueDirs, Trials, CovDir);
+  if (auto E = CovsOrErr.takeError()) {
+    return E;
+  }
+  auto &Covs = *CovsOrErr;
+  success_stream() << Covs.size() << " raw profiles generated\n";
+
+  // Read each unique raw profile
+  status_stream() << "Reading " << Covs.size() << " raw profiles...\n";
+
+  std::vector<Optional<Expected<ProfileCounts>>> Parsed(Covs.size());
+
+  ThreadPool Pool(hardware_concurrency(Opts.NumThreads));
+  for (size_t Idx = 0; Idx < Covs.size(); ++Idx) {
+    Pool.async([&, Idx]() {
+      auto &RawCov = Covs[Idx];
+      auto BufOrErr = RawCov.load();
+      if (auto E = BufOrErr.takeError()) {
+        Parsed[Idx] = std::move(E);
+        return;
+      }
+      Parsed[Idx] = Accum.readProfile(*BufOrErr);
+      RawCov.Buf.reset();
+    });
+  }
+  Pool.wait();
+  if (!CovDir.empty()) {
+    sys::fs::remove_directories(CovDir);
+  }
 
-    auto CovMapOrErr =
-        coverage::CoverageMapping::load(CovReaders, *IndexedReaderOrErr.get());
-    if (auto E = CovMapOrErr.takeError()) {
-      return std::move(E);
+  StringMap<ProfileCounts> Profiles;
+  for (size_t Idx = 0; Idx < Covs.size(); ++Idx) {
+    auto &CountsOrErr = *Parsed[Idx];
+    if (auto E = CountsOrErr.takeError()) {
+      warning_stream() << '`' << Covs[Idx].Path << "`: " << E
+                       << ". Skipping...\n";
+      continue;
     }
-    CovMap = std::move(*CovMapOrErr);
+    Profiles[sys::path::filename(Covs[Idx].Path)] = std::move(*CountsOrErr);
+  }
+  Parsed.clear();
+
+  //
+  // Accumulate coverage for each trial
+  //
 
-    //
-    // Calculate coverage
-    //
+  for (const auto &T : Trials) {
+    const auto Out = getTrialOutput(OutJSON, T.QueueDir);
+    Accum.reset();
 
-    auto Count = 0;
-    for (const auto &Func : CovMap->getCoveredFunctions()) {
-      // This function was never executed
-      if (!Func.ExecutionCount) {
-        continue;
+    const auto Accumulate = [&](size_t Idx) -> bool {
+      const auto It = Profiles.find(T.Hashes[Idx]);
+      if (It == Profiles.end()) {
+        return false;
+      }
+      Accum.add(It->second);
+      return true;
+    };
+
+    if (Timestamps == TimestampSource::None) {
+      TestcaseCoverages Cov;
+      for (size_t Idx = 0; Idx < T.Testcases.size(); ++Idx) {
+        if (Accumulate(Idx)) {
+          Accum.flush();
+          Cov.emplace_back(T.Testcases[Idx], Accum.count());
+        }
+      }
+      if (auto E = writeJSON(Out, Cov)) {
+        return E;
+      }
+    } else {
+      RawCoverages Testcases;
+      for (const auto &Name : T.Testcases) {
+        Testcases.push_back({Name, nullptr});
+      }
+      auto BinsOrErr = binCoverages(Testcases, T.QueueDir, Timestamps,
+                                    TimestampCSV, BinSize);
+      if (auto E = BinsOrErr.takeError()) {
+        return E;
       }
 
-      // We only care about code regions
-      for (const auto &R : Func.CountedRegions) {
-        if (R.Kind == coverage::CountedRegion::RegionKind::CodeRegion &&
-            R.ExecutionCount > 0) {
-          Count++;
+      TimeBinCoverages Cov;
+      for (size_t Bin = 0; Bin < BinsOrErr->size(); ++Bin) {
+        for (const auto Idx : (*BinsOrErr)[Bin]) {
+          Accumulate(Idx);
         }
+        Accum.flush();
+        Cov.emplace_back((Bin + 1) * BinSize, Accum.count());
+      }
+      if (auto E = writeJSON(Out, Cov)) {
+        return E;
       }
     }
 
-    TestcaseCovs.emplace_back(sys::path::filename(CovFile).str(), Count);
-
-    const auto &Idx = CovFileEnum.index();
-    if (Idx % ((NumCovFiles + (10 - 1)) / 10) == 0) {
-      status_stream() << "  ";
-      write_double(outs(), static_cast<float>(Idx) / NumCovFiles,
-                   FloatStyle::Percent);
-      outs() << " raw profiles parsed (count = " << Count << ")\r";
-    }
+    success_stream() << '`' << T.QueueDir << "`: " << Accum.count()
+                     << " regions (written to " << Out << ")\n";
   }
-  outs() << '\n';
 
-  return TestcaseCovs;
+  return Error::success();
 }
 } // anonymous namespace
 
@@ -207,29 +305,63 @@ int main(int argc, char *argv[]) {
       "Generate coverage over time by replaying sampled test cases through an "
       "LLVM SanCov-instrumented binary\n");
 
-  if (!sys::fs::is_directory(QueueDir)) {
-    error_stream() << QueueDir << " is an invalid directory\n";
+  for (const auto &QueueDir : QueueDirs) {
+    if (!sys::fs::is_directory(QueueDir)) {
+      error_stream() << QueueDir << " is an invalid directory\n";
+      return 1;
+    }
+  }
+
+  if (Timestamps == TimestampSource::CSV && TimestampCSV.empty()) {
+    error_stream() << "-timestamps=csv requires -timestamp-csv\n";
     return 1;
   }
 
-  SmallString<16> CovDir;
-  ExitOnErr(
-      errorCodeToError(sys::fs::createUniqueDirectory("coverage", CovDir)));
+  ReplayOptions Opts;
+  Opts.Target = Target;
+  Opts.TargetArgs = TargetArgs;
+  Opts.NumThreads = NumThreads;
+  Opts.ForkServer = UseForkServer;
+  Opts.Shm = UseShm;
+  Opts.CacheDir = CacheDir;
+
+  if (QueueDirs.size() > 1) {
+    ExitOnErr(replayBatch(Opts));
+    return 0;
+  }
+  const auto &QueueDir = QueueDirs.front();
 
   // Collect raw coverage
-  const auto NumTestcases = ExitOnErr(getNumFiles(QueueDir));
-  status_stream() << "Generating raw profiles for " << NumTestcases
-                  << " testcases (in `" << QueueDir << "`) using target `"
-                  << Target << "`...\n";
-  ExitOnErr(genCoverage(Target, TargetArgs, QueueDir, CovDir, NumThreads));
-  const auto NumCovFiles = ExitOnErr(getNumFiles(CovDir));
-  success_stream() << NumCovFiles << " raw profiles generated\n";
+  SmallString<16> CovDir;
+  auto Covs = ExitOnErr(replayQueue(Opts, QueueDir, CovDir));
+  success_stream() << Covs.size() << " raw profiles generated\n";
+
+  // Accumulate coverage (over time buckets, if timestamps are available)
+  if (Timestamps != TimestampSource::None) {
+    const auto Bins = ExitOnErr(
+        binCoverages(Covs, QueueDir, Timestamps, TimestampCSV, BinSize));
+    status_stream() << "Accumulating " << Covs.size()
+                    << " raw profiles into " << Bins.size()
+                    << " time buckets...\n";
+    const auto &Cov = ExitOnErr(
+        accumulateBinnedCoverage(Covs, Bins, BinSize, Target, NumThreads));
+    if (!CovDir.empty()) {
+      sys::fs::remove_directories(CovDir);
+    }
+    success_stream() << "Coverage accumulation complete\n";
+
+    status_stream() << "Writing coverage to " << OutJSON << "...\n";
+    ExitOnErr(writeJSON(OutJSON, Cov));
+    return 0;
+  }
 
   // Accumulate coverage
-  status_stream() << "Accumulating " << NumCovFiles << " raw profiles in "
-                  << CovDir << '\n';
-  const auto &Cov = ExitOnErr(accumulateCoverage(CovDir, Target));
-  sys::fs::remove_directories(CovDir);
+  status_stream() << "Accumulating " << Covs.size() << " raw profiles...\n";
+  const auto &Cov =
+      ExitOnErr(accumulateRegionCoverage(Covs, Target, NumThreads));
+  if (!CovDir.empty()) {
+    sys::fs::remove_directories(CovDir);
+  }
   success_stream() << "Coverage accumulation complete\n";
 
   // Write to JSON